@@ -9,6 +9,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <inttypes.h>
 #include <sys/param.h>
 
 #include "freertos/FreeRTOS.h"
@@ -32,12 +33,39 @@
 #include "esp_delta_ota.h"
 
 #include "delta_ota.h"
+#if CONFIG_DOTA_IN_PLACE_UPDATE
+#include "delta_ota_in_place.h"
+#endif
 
 #define BUFFSIZE 1024
 #define PATCH_HEADER_SIZE 64
 #define DIGEST_SIZE 32
+#define PATCH_INFO_VERSION 1
+#define PATCH_INFO_TARGET_DIGEST_SIZE 16
+#define PATCH_TYPE_SEQUENTIAL 0
+#define PATCH_TYPE_IN_PLACE 1
+#define PATCH_COMPRESSION_HEATSHRINK 4  // detools numbering, the only compression the detools library is built with
+/* Delays between the attempts to complete an interrupted in-place update, doubled after each failed attempt */
+#define IN_PLACE_RETRY_DELAY_MIN_MS 5000
+#define IN_PLACE_RETRY_DELAY_MAX_MS 300000
 static uint32_t esp_delta_ota_magic = 0xfccdde10;
 
+/* Patch header written by esp_delta_ota_patch_gen.py. The patch information fields are only valid when
+ * info_version is set, older patches leave them zeroed. */
+typedef struct __attribute__((packed)) {
+    uint32_t magic;
+    uint8_t base_digest[DIGEST_SIZE];
+    uint8_t info_version;
+    uint8_t compression;
+    uint8_t patch_type;
+    uint8_t reserved;
+    uint32_t target_size;
+    uint32_t patch_size;
+    uint8_t target_digest[PATCH_INFO_TARGET_DIGEST_SIZE];
+} patch_header_t;
+
+_Static_assert(sizeof(patch_header_t) == PATCH_HEADER_SIZE, "Unexpected patch header size");
+
 static bool start_ota = false;
 
 static const char *TAG = "delta_ota_task";
@@ -45,6 +73,8 @@ static const char *TAG = "delta_ota_task";
 static char ota_write_data[BUFFSIZE + 1] = { 0 };
 
 const esp_partition_t *current_partition, *destination_partition;
+
+#if !CONFIG_DOTA_IN_PLACE_UPDATE
 static esp_ota_handle_t ota_handle;
 
 #define IMG_HEADER_LEN sizeof(esp_image_header_t)
@@ -105,6 +135,7 @@ static esp_err_t read_cb(uint8_t *buf_p, size_t size, int src_offset)
     }
     return esp_partition_read(current_partition, src_offset, buf_p, size);
 }
+#endif
 
 static void reboot(void)
 {
@@ -121,24 +152,67 @@ static void http_cleanup(esp_http_client_handle_t client)
     esp_http_client_cleanup(client);
 }
 
-static bool verify_patch_header(void *img_hdr_data)
+/* base_partition holds the firmware the patch applies to: the running partition for sequential patches, the app
+ * partition for in-place patches */
+static bool verify_patch_header(const patch_header_t *header, int64_t content_length, const esp_partition_t *base_partition)
 {
-    if (!img_hdr_data) {
+    if (!header) {
         return false;
     }
-    uint32_t recv_magic = *(uint32_t *)img_hdr_data;
-    uint8_t *digest = (uint8_t *)(img_hdr_data + 4);
 
-    if (recv_magic != esp_delta_ota_magic) {
+    if (header->magic != esp_delta_ota_magic) {
         ESP_LOGE(TAG, "Invalid magic word in patch");
         return false;
     }
     uint8_t sha_256[DIGEST_SIZE] = { 0 };
-    esp_partition_get_sha256(esp_ota_get_running_partition(), sha_256);
-    if (memcmp(sha_256, digest, DIGEST_SIZE) != 0) {
+    esp_partition_get_sha256(base_partition, sha_256);
+#if CONFIG_DOTA_IN_PLACE_UPDATE
+    // An interrupted in-place update left the app partition half patched, the journal tells that it is the same patch
+    bool resuming = delta_ota_in_place_pending(header, sizeof(*header));
+#else
+    bool resuming = false;
+#endif
+    if (!resuming && memcmp(sha_256, header->base_digest, DIGEST_SIZE) != 0) {
         ESP_LOGE(TAG, "SHA256 of current firmware differs from than in patch header. Invalid patch for current firmware");
         return false;
     }
+
+#if CONFIG_DOTA_IN_PLACE_UPDATE
+    if (header->info_version < PATCH_INFO_VERSION || header->patch_type != PATCH_TYPE_IN_PLACE) {
+        ESP_LOGE(TAG, "Not an in-place patch");
+        return false;
+    }
+#else
+    if (header->info_version < PATCH_INFO_VERSION) {
+        return true;
+    }
+    if (header->patch_type != PATCH_TYPE_SEQUENTIAL) {
+        ESP_LOGE(TAG, "Not a sequential patch");
+        return false;
+    }
+#endif
+    ESP_LOGI(TAG, "Patch: %" PRIu32 " bytes, compression %d, new firmware: %" PRIu32 " bytes",
+             header->patch_size, header->compression, header->target_size);
+    if (header->compression != PATCH_COMPRESSION_HEATSHRINK) {
+        ESP_LOGE(TAG, "Unsupported patch compression %d", header->compression);
+        return false;
+    }
+    if (resuming) {
+        return true;
+    }
+    if (memcmp(sha_256, header->target_digest, PATCH_INFO_TARGET_DIGEST_SIZE) == 0) {
+        ESP_LOGW(TAG, "Patch targets the firmware that is already running, nothing to update");
+        return false;
+    }
+    if (header->target_size > destination_partition->size) {
+        ESP_LOGE(TAG, "New firmware (%" PRIu32 " bytes) does not fit in partition %s (%" PRIu32 " bytes)",
+                 header->target_size, destination_partition->label, destination_partition->size);
+        return false;
+    }
+    if (content_length > 0 && content_length != PATCH_HEADER_SIZE + (int64_t)header->patch_size) {
+        ESP_LOGE(TAG, "Patch size from server (%" PRId64 " bytes) differs from the patch header", content_length);
+        return false;
+    }
     return true;
 }
 
@@ -162,10 +236,115 @@ static void init_gpio(void)
     gpio_isr_handler_add(CONFIG_DOTA_GPIO_BUTTON, gpio_callback, NULL);
 }
 
-static void ota_example_task(void *pvParameters)
+typedef esp_err_t (*patch_feed_cb_t)(void *ctx, const uint8_t *data, size_t size);
+
+#if CONFIG_DOTA_IN_PLACE_UPDATE
+static esp_err_t in_place_feed(void *ctx, const uint8_t *data, size_t size)
 {
-    esp_err_t err;
+    return delta_ota_in_place_feed((delta_ota_in_place_handle_t)ctx, data, size);
+}
+#else
+static esp_err_t delta_ota_feed(void *ctx, const uint8_t *data, size_t size)
+{
+    return esp_delta_ota_feed_patch((esp_delta_ota_handle_t)ctx, data, size);
+}
+#endif
 
+// Reads the patch body from the connection and passes it to feed
+static esp_err_t read_patch(esp_http_client_handle_t client, patch_feed_cb_t feed, void *ctx)
+{
+    while (1) {
+        int data_read = esp_http_client_read(client, ota_write_data, BUFFSIZE);
+        if (data_read < 0) {
+            ESP_LOGE(TAG, "Error: SSL data read error");
+            return ESP_FAIL;
+        } else if (data_read > 0) {
+            if (feed(ctx, (const uint8_t *)ota_write_data, data_read) != ESP_OK) {
+                ESP_LOGE(TAG, "Error while applying patch");
+                return ESP_FAIL;
+            }
+        } else if (data_read == 0) {
+            if (esp_http_client_is_complete_data_received(client) == true) {
+                ESP_LOGI(TAG, "Connection closed");
+                return ESP_OK;
+            }
+            if (errno == ECONNRESET || errno == ENOTCONN) {
+                ESP_LOGE(TAG, "Connection closed, errno = %d", errno);
+                return ESP_OK;
+            }
+        }
+    }
+}
+
+#if CONFIG_DOTA_IN_PLACE_UPDATE
+/* The app partition is patched while the firmware runs from the recovery (factory) partition. The application
+ * switches to the recovery when an update is requested, and the recovery boots the application back once the
+ * update is done, or right away when there is nothing to resume. */
+static void restart_in_recovery(void)
+{
+    const esp_partition_t *recovery = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_FACTORY, NULL);
+    if (recovery == NULL) {
+        ESP_LOGE(TAG, "No recovery (factory) partition, in-place update not possible");
+        return;
+    }
+    esp_err_t err = esp_ota_set_boot_partition(recovery);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "esp_ota_set_boot_partition() failed : %s", esp_err_to_name(err));
+        return;
+    }
+    ESP_LOGI(TAG, "Restarting in recovery to apply the update");
+    reboot();
+}
+
+/* Boots the application back after a failed attempt. Returns after a delay, for the update to be attempted again
+ * without a reboot, when the app partition is half patched, since the only way out is then to complete the update,
+ * or when there is no valid application to boot. The delay doubles up to IN_PLACE_RETRY_DELAY_MAX_MS, so that a
+ * server that stays unreachable is not polled in a loop. */
+static void leave_recovery(uint32_t *retry_delay_ms)
+{
+    if (delta_ota_in_place_pending(NULL, 0)) {
+        ESP_LOGW(TAG, "In-place update not completed, retrying in %" PRIu32 " s", *retry_delay_ms / 1000);
+    } else {
+        esp_err_t err = esp_ota_set_boot_partition(esp_ota_get_next_update_partition(NULL));
+        if (err == ESP_OK) {
+            reboot();
+        }
+        ESP_LOGE(TAG, "No valid application to boot (%s), retrying in %" PRIu32 " s", esp_err_to_name(err),
+                 *retry_delay_ms / 1000);
+    }
+    vTaskDelay(*retry_delay_ms / portTICK_PERIOD_MS);
+    *retry_delay_ms = *retry_delay_ms < IN_PLACE_RETRY_DELAY_MAX_MS / 2 ? *retry_delay_ms * 2 : IN_PLACE_RETRY_DELAY_MAX_MS;
+}
+
+static esp_err_t apply_in_place_patch(esp_http_client_handle_t client, const patch_header_t *patch_header)
+{
+    delta_ota_in_place_handle_t handle;
+    esp_err_t err = delta_ota_in_place_begin(destination_partition, patch_header, sizeof(*patch_header),
+                                             patch_header->patch_size, &handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "delta_ota_in_place_begin() failed : %s", esp_err_to_name(err));
+        return err;
+    }
+    err = read_patch(client, in_place_feed, handle);
+    if (err != ESP_OK) {
+        delta_ota_in_place_abort(handle);
+        return err;
+    }
+    err = delta_ota_in_place_finalize(handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = esp_ota_set_boot_partition(destination_partition);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "esp_ota_set_boot_partition() failed : %s", esp_err_to_name(err));
+        return err;
+    }
+    return delta_ota_in_place_clear_journal();
+}
+#endif
+
+static void wait_for_button(void)
+{
     init_gpio();
 
     while(!start_ota) {
@@ -176,6 +355,24 @@ static void ota_example_task(void *pvParameters)
 
     ESP_LOGI(TAG, "GPIO%d pressed!! Starting delta OTA...",
              CONFIG_DOTA_GPIO_BUTTON);
+}
+
+static void ota_example_task(void *pvParameters)
+{
+    esp_err_t err;
+
+#if CONFIG_DOTA_IN_PLACE_UPDATE
+    if (esp_ota_get_running_partition()->subtype != ESP_PARTITION_SUBTYPE_APP_FACTORY) {
+        wait_for_button();
+        restart_in_recovery();
+        vTaskDelete(NULL);
+    }
+    uint32_t retry_delay_ms = IN_PLACE_RETRY_DELAY_MIN_MS;
+retry:
+    ESP_LOGI(TAG, "Running from recovery, starting in-place delta OTA...");
+#else
+    wait_for_button();
+#endif
 
     esp_http_client_config_t config = {
         .url = CONFIG_DOTA_FIRMWARE_UPG_URL,
@@ -190,15 +387,19 @@ static void ota_example_task(void *pvParameters)
     esp_http_client_handle_t client = esp_http_client_init(&config);
     if (client == NULL) {
         ESP_LOGE(TAG, "Failed to initialise HTTP connection");
-        vTaskDelete(NULL);
+        goto end;
     }
     err = esp_http_client_open(client, 0);
     if (err != ESP_OK) {
         ESP_LOGE(TAG, "Failed to open HTTP connection: %s", esp_err_to_name(err));
         esp_http_client_cleanup(client);
+#if CONFIG_DOTA_IN_PLACE_UPDATE
+        goto end;
+#else
         vTaskSuspend(NULL);
+#endif
     }
-    esp_http_client_fetch_headers(client);
+    int64_t content_length = esp_http_client_fetch_headers(client);
 
     current_partition = esp_ota_get_running_partition();
     destination_partition = esp_ota_get_next_update_partition(NULL);
@@ -213,7 +414,35 @@ static void ota_example_task(void *pvParameters)
         goto error;
     }
 
-    err = esp_ota_begin(destination_partition, OTA_SIZE_UNKNOWN, &(ota_handle));
+    // Read size equal to patch header to verify the header before anything is erased
+    patch_header_t patch_header;
+    int data_read = esp_http_client_read(client, (char *)&patch_header, PATCH_HEADER_SIZE);
+    if (data_read != PATCH_HEADER_SIZE) {
+        ESP_LOGE(TAG, "Patch Header not received");
+        goto error;
+    }
+#if CONFIG_DOTA_IN_PLACE_UPDATE
+    if (!verify_patch_header(&patch_header, content_length, destination_partition)) {
+        ESP_LOGE(TAG, "Patch Header verification failed");
+        goto error;
+    }
+    if (apply_in_place_patch(client, &patch_header) != ESP_OK) {
+        goto error;
+    }
+    http_cleanup(client);
+    reboot();
+#else
+    if (!verify_patch_header(&patch_header, content_length, current_partition)) {
+        ESP_LOGE(TAG, "Patch Header verification failed");
+        goto error;
+    }
+
+    // When the patch header tells the size of the new firmware, only that part of the partition is erased
+    size_t image_size = OTA_SIZE_UNKNOWN;
+    if (patch_header.info_version >= PATCH_INFO_VERSION) {
+        image_size = patch_header.target_size;
+    }
+    err = esp_ota_begin(destination_partition, image_size, &(ota_handle));
     if (err != ESP_OK) {
         ESP_LOGE(TAG, "esp_ota_begin failed: %s", esp_err_to_name(err));
         goto error;
@@ -236,38 +465,9 @@ static void ota_example_task(void *pvParameters)
         goto error;
     }
 
-    // Read size equal to patch header to verify the header
-    int data_read = esp_http_client_read(client, ota_write_data, PATCH_HEADER_SIZE);
-    if (data_read != PATCH_HEADER_SIZE) {
-        ESP_LOGE(TAG, "Patch Header not received");
-        goto error;
-    }
-    if (!verify_patch_header(ota_write_data)) {
-        ESP_LOGE(TAG, "Patch Header verification failed");
+    if (read_patch(client, delta_ota_feed, handle) != ESP_OK) {
         goto error;
     }
-
-    while (1) {
-        int data_read = esp_http_client_read(client, ota_write_data, BUFFSIZE);
-        if (data_read < 0) {
-            ESP_LOGE(TAG, "Error: SSL data read error");
-            goto error;
-        } else if (data_read > 0) {
-            if (esp_delta_ota_feed_patch(handle, (const uint8_t *)ota_write_data, data_read) < 0) {
-                ESP_LOGE(TAG, "Error while applying patch");
-                goto error;
-            }
-        } else if (data_read == 0) {
-            if (esp_http_client_is_complete_data_received(client) == true) {
-                ESP_LOGI(TAG, "Connection closed");
-                break;
-            }
-            if (errno == ECONNRESET || errno == ENOTCONN) {
-                ESP_LOGE(TAG, "Connection closed, errno = %d", errno);
-                break;
-            }
-        }
-    }
     err = esp_delta_ota_finalize(handle);
     if (err != ESP_OK) {
         ESP_LOGE(TAG, "esp_delta_ota_finalize() failed : %s", esp_err_to_name(err));
@@ -286,9 +486,16 @@ static void ota_example_task(void *pvParameters)
     }
     http_cleanup(client);
     reboot();
+#endif
 error:
     http_cleanup(client);
+end:
+#if CONFIG_DOTA_IN_PLACE_UPDATE
+    leave_recovery(&retry_delay_ms);
+    goto retry;
+#else
     vTaskDelete(NULL);
+#endif
 }
 
 esp_err_t dota_init(void)
@@ -0,0 +1,199 @@
+/* In-place delta OTA
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_err.h"
+#include "esp_partition.h"
+#include "nvs.h"
+
+#include "detools.h"
+
+#include "delta_ota_in_place.h"
+
+/* The journal is the patch header and the last step detools completed. detools applies an in-place patch in steps
+ * (moving the base image, then one segment of the new image at a time) and can skip the completed ones when the
+ * same patch is fed again, so that a power failure at any point only costs the step in progress. */
+#define JOURNAL_NAMESPACE "dota_journal"
+#define JOURNAL_PATCH_KEY "patch"
+#define JOURNAL_STEP_KEY "step"
+#define JOURNAL_MAX_HEADER_SIZE 64
+
+struct delta_ota_in_place {
+    struct detools_apply_patch_in_place_t apply_patch;
+    const esp_partition_t *partition;
+    nvs_handle_t journal;
+};
+
+static const char *TAG = "delta_ota_in_place";
+
+static int mem_read(void *arg_p, void *dst_p, uintptr_t src, size_t size)
+{
+    struct delta_ota_in_place *self = arg_p;
+    return esp_partition_read(self->partition, src, dst_p, size) == ESP_OK ? 0 : -1;
+}
+
+static int mem_write(void *arg_p, uintptr_t dst, void *src_p, size_t size)
+{
+    struct delta_ota_in_place *self = arg_p;
+    return esp_partition_write(self->partition, dst, src_p, size) == ESP_OK ? 0 : -1;
+}
+
+static int mem_erase(void *arg_p, uintptr_t addr, size_t size)
+{
+    struct delta_ota_in_place *self = arg_p;
+    return esp_partition_erase_range(self->partition, addr, size) == ESP_OK ? 0 : -1;
+}
+
+static int step_set(void *arg_p, int step)
+{
+    struct delta_ota_in_place *self = arg_p;
+    esp_err_t err = nvs_set_i32(self->journal, JOURNAL_STEP_KEY, step);
+    if (err == ESP_OK) {
+        err = nvs_commit(self->journal);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to save step %d: %s", step, esp_err_to_name(err));
+        return -1;
+    }
+    ESP_LOGI(TAG, "Step %d done", step);
+    return 0;
+}
+
+static int step_get(void *arg_p, int *step_p)
+{
+    struct delta_ota_in_place *self = arg_p;
+    int32_t step = 0;
+    esp_err_t err = nvs_get_i32(self->journal, JOURNAL_STEP_KEY, &step);
+    if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) {
+        ESP_LOGE(TAG, "Failed to read step: %s", esp_err_to_name(err));
+        return -1;
+    }
+    *step_p = step;
+    return 0;
+}
+
+static bool journal_has_patch(nvs_handle_t journal, const void *patch_header, size_t header_size)
+{
+    uint8_t saved_header[JOURNAL_MAX_HEADER_SIZE];
+    size_t saved_size = sizeof(saved_header);
+    if (nvs_get_blob(journal, JOURNAL_PATCH_KEY, saved_header, &saved_size) != ESP_OK) {
+        return false;
+    }
+    return patch_header == NULL || (saved_size == header_size && memcmp(saved_header, patch_header, header_size) == 0);
+}
+
+bool delta_ota_in_place_pending(const void *patch_header, size_t header_size)
+{
+    nvs_handle_t journal;
+    if (nvs_open(JOURNAL_NAMESPACE, NVS_READONLY, &journal) != ESP_OK) {
+        return false;
+    }
+    bool pending = journal_has_patch(journal, patch_header, header_size);
+    nvs_close(journal);
+    return pending;
+}
+
+esp_err_t delta_ota_in_place_clear_journal(void)
+{
+    nvs_handle_t journal;
+    esp_err_t err = nvs_open(JOURNAL_NAMESPACE, NVS_READWRITE, &journal);
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = nvs_erase_all(journal);
+    if (err == ESP_OK) {
+        err = nvs_commit(journal);
+    }
+    nvs_close(journal);
+    return err;
+}
+
+esp_err_t delta_ota_in_place_begin(const esp_partition_t *partition, const void *patch_header, size_t header_size,
+                                   size_t patch_size, delta_ota_in_place_handle_t *handle)
+{
+    if (partition == NULL || patch_header == NULL || header_size > JOURNAL_MAX_HEADER_SIZE || handle == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    struct delta_ota_in_place *self = calloc(1, sizeof(*self));
+    if (self == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    self->partition = partition;
+
+    esp_err_t err = nvs_open(JOURNAL_NAMESPACE, NVS_READWRITE, &self->journal);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to open the journal: %s", esp_err_to_name(err));
+        free(self);
+        return err;
+    }
+
+    if (journal_has_patch(self->journal, patch_header, header_size)) {
+        int step = 0;
+        step_get(self, &step);
+        ESP_LOGI(TAG, "Resuming interrupted update after step %d", step);
+    } else {
+        // The step is erased first, so that a journal never pairs a patch with the progress of another one
+        err = nvs_erase_key(self->journal, JOURNAL_STEP_KEY);
+        if (err == ESP_OK || err == ESP_ERR_NVS_NOT_FOUND) {
+            err = nvs_set_blob(self->journal, JOURNAL_PATCH_KEY, patch_header, header_size);
+        }
+        if (err == ESP_OK) {
+            err = nvs_commit(self->journal);
+        }
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to write the journal: %s", esp_err_to_name(err));
+            nvs_close(self->journal);
+            free(self);
+            return err;
+        }
+    }
+
+    int res = detools_apply_patch_in_place_init(&self->apply_patch, mem_read, mem_write, mem_erase, step_set,
+                                                step_get, patch_size, self);
+    if (res != 0) {
+        ESP_LOGE(TAG, "detools_apply_patch_in_place_init() failed: %s", detools_error_as_string(res));
+        nvs_close(self->journal);
+        free(self);
+        return ESP_FAIL;
+    }
+    *handle = self;
+    return ESP_OK;
+}
+
+esp_err_t delta_ota_in_place_feed(delta_ota_in_place_handle_t handle, const uint8_t *data, size_t size)
+{
+    int res = detools_apply_patch_in_place_process(&handle->apply_patch, data, size);
+    if (res != 0) {
+        ESP_LOGE(TAG, "Failed to apply patch: %s", detools_error_as_string(res));
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+esp_err_t delta_ota_in_place_finalize(delta_ota_in_place_handle_t handle)
+{
+    int res = detools_apply_patch_in_place_finalize(&handle->apply_patch);
+    nvs_close(handle->journal);
+    free(handle);
+    if (res < 0) {
+        ESP_LOGE(TAG, "Failed to finalize patch: %s", detools_error_as_string(res));
+        return ESP_FAIL;
+    }
+    ESP_LOGI(TAG, "New image of %d bytes written in place", res);
+    return ESP_OK;
+}
+
+void delta_ota_in_place_abort(delta_ota_in_place_handle_t handle)
+{
+    nvs_close(handle->journal);
+    free(handle);
+}
@@ -0,0 +1,40 @@
+/* In-place delta OTA
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "esp_partition.h"
+
+typedef struct delta_ota_in_place *delta_ota_in_place_handle_t;
+
+/* Starts applying an in-place patch of patch_size bytes (without the patch header) into partition, which holds the
+ * base image. The patch header identifies the patch in the progress journal: when the previous attempt to apply the
+ * same patch was interrupted, the steps it completed are skipped. */
+esp_err_t delta_ota_in_place_begin(const esp_partition_t *partition, const void *patch_header, size_t header_size,
+                                   size_t patch_size, delta_ota_in_place_handle_t *handle);
+
+/* Applies the next bytes of the patch, the whole patch must be fed again when resuming */
+esp_err_t delta_ota_in_place_feed(delta_ota_in_place_handle_t handle, const uint8_t *data, size_t size);
+
+/* Checks that the whole patch was applied and frees the handle. The journal is kept until
+ * delta_ota_in_place_clear_journal() is called, once the new image is selected for boot. */
+esp_err_t delta_ota_in_place_finalize(delta_ota_in_place_handle_t handle);
+
+/* Frees the handle, keeping the journal so that the update is resumed by the next attempt */
+void delta_ota_in_place_abort(delta_ota_in_place_handle_t handle);
+
+/* Returns true when the journal records an update in progress, of the given patch or of any patch when
+ * patch_header is NULL. The app partition does not hold a valid image until that update completes. */
+bool delta_ota_in_place_pending(const void *patch_header, size_t header_size);
+
+esp_err_t delta_ota_in_place_clear_journal(void);
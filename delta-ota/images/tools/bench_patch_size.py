@@ -0,0 +1,194 @@
+#!/usr/bin/env python
+#
+# Patch size benchmark for the ESP Delta OTA Patch Generator Tool. Runs the generator over a corpus of base/new
+# image pairs, records the patch size, generation time and host apply time of each pair into a CSV file and fails
+# when a patch grows by more than a threshold compared to a baseline CSV.
+#
+# SPDX-FileCopyrightText: 2023 Espressif Systems (Shanghai) CO LTD
+# SPDX-License-Identifier: Apache-2.0
+
+import argparse
+import csv
+import hashlib
+import os
+import struct
+import sys
+import time
+from esptool.targets import CHIP_DEFS
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import esp_delta_ota_patch_gen as patch_gen
+
+IMAGES_DIR = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+DEFAULT_BASE_BINARY = os.path.join(IMAGES_DIR, "https_delta_ota_board.bin")
+DEFAULT_NEW_BINARY = os.path.join(IMAGES_DIR, "https_delta_ota_new.bin")
+DEFAULT_BASELINE = os.path.join(os.path.dirname(os.path.abspath(__file__)), "bench_baseline.csv")
+DEFAULT_THRESHOLD = 2.0 # %, allowed patch size growth compared to the baseline
+
+CSV_FIELDS = ['case', 'new_size', 'patch_size', 'ratio', 'generation_time_s', 'apply_time_s', 'verified']
+
+CODE_EDIT_SIZE = 32 # Bytes rewritten at each of the code edit locations
+CODE_EDIT_COUNT = 3
+MIN_STRING_LENGTH = 16 # Shortest NUL terminated printable string the string edit picks
+DATA_TABLE_SIZE = 4096 # Bytes inserted by the data table growth edit
+
+# Rebuilds a valid ESP app image (segment headers, checksum and appended SHA-256) from the image header of an
+# existing image and a list of (load_addr, data) segments
+def build_image(image_header: bytes, segments: list) -> bytes:
+    image = bytearray(image_header[:patch_gen.IMAGE_HEADER_SIZE])
+    image[1] = len(segments)
+    checksum = patch_gen.CHECKSUM_MAGIC
+    for load_addr, data in segments:
+        image += struct.pack("<II", load_addr, len(data)) + data
+        for byte in data:
+            checksum ^= byte
+    image += bytes(15 - len(image) % 16)
+    image.append(checksum)
+    if image[patch_gen.IMAGE_HASH_APPENDED_OFFSET] == 1:
+        image += hashlib.sha256(image).digest()
+    return bytes(image)
+
+def split_image(image: bytes) -> list:
+    layout = patch_gen.parse_image(image)
+    return [(segment.load_addr, bytearray(image[segment.data_offset:segment.data_offset + segment.data_len]))
+            for segment in layout.segments]
+
+def find_segment(segments: list, start: int, end: int) -> int:
+    # The largest segment mapped in [start, end), i.e. the flash mapped code or read only data
+    candidates = [index for index, (load_addr, data) in enumerate(segments) if start <= load_addr < end]
+    if not candidates:
+        raise ValueError(f"no segment mapped at 0x{start:08x}-0x{end:08x}")
+    return max(candidates, key=lambda index: len(segments[index][1]))
+
+# Small code change: a few instruction words rewritten in place, as a bug fix in one function would do
+def edit_code(chip: str, image: bytes) -> bytes:
+    segments = split_image(image)
+    chip_def = CHIP_DEFS[chip]
+    data = segments[find_segment(segments, chip_def.IROM_MAP_START, chip_def.IROM_MAP_END)][1]
+    for n in range(1, CODE_EDIT_COUNT + 1):
+        offset = len(data) * n // (CODE_EDIT_COUNT + 1) & ~3
+        data[offset:offset + CODE_EDIT_SIZE] = bytes(b ^ 0x5A for b in data[offset:offset + CODE_EDIT_SIZE])
+    return build_image(image, segments)
+
+# String change: a log message reworded with the same length, so nothing else moves
+def edit_string(chip: str, image: bytes) -> bytes:
+    segments = split_image(image)
+    chip_def = CHIP_DEFS[chip]
+    data = segments[find_segment(segments, chip_def.DROM_MAP_START, chip_def.DROM_MAP_END)][1]
+    start = None
+    for offset in range(len(data) // 2, len(data)):
+        if 0x20 <= data[offset] < 0x7F:
+            if start is None:
+                start = offset
+        elif data[offset] == 0 and start is not None and offset - start >= MIN_STRING_LENGTH:
+            break
+        else:
+            start = None
+    else:
+        raise ValueError("no string found to edit")
+    data[start:offset] = data[start:offset].swapcase()
+    return build_image(image, segments)
+
+# Data table growth: a constant table added in the middle of the read only data, which moves everything after it
+def grow_data_table(chip: str, image: bytes) -> bytes:
+    segments = split_image(image)
+    chip_def = CHIP_DEFS[chip]
+    index = find_segment(segments, chip_def.DROM_MAP_START, chip_def.DROM_MAP_END)
+    load_addr, data = segments[index]
+    offset = len(data) // 2 & ~3
+    table = b"".join(struct.pack("<I", (n * 2654435761) & 0xFFFFFFFF) for n in range(DATA_TABLE_SIZE // 4))
+    segments[index] = (load_addr, data[:offset] + table + data[offset:])
+    return build_image(image, segments)
+
+SYNTHETIC_EDITS = [('code_change', edit_code), ('string_change', edit_string), ('data_table_growth', grow_data_table)]
+
+def build_corpus(chip: str, base_binary: str, new_binary: str) -> list:
+    with open(base_binary, "rb") as b_binary, open(new_binary, "rb") as n_binary:
+        base_data = b_binary.read()
+        new_data = n_binary.read()
+    corpus = [('release', base_data, new_data)]
+    for name, edit in SYNTHETIC_EDITS:
+        corpus.append((name, new_data, edit(chip, new_data)))
+    return corpus
+
+def run_case(name: str, base_data: bytes, new_data: bytes, diff_mode: str, optimize: str) -> dict:
+    start = time.monotonic()
+    patch_body = patch_gen.create_patch_body(base_data, new_data, None, diff_mode, optimize)
+    generation_time = time.monotonic() - start
+
+    start = time.monotonic()
+    verified = patch_gen.verify_patch_data(base_data, patch_body, hashlib.sha256(new_data).hexdigest())
+    apply_time = time.monotonic() - start
+
+    patch_size = patch_gen.HEADER_SIZE + len(patch_body)
+    return {'case': name, 'new_size': len(new_data), 'patch_size': patch_size,
+            'ratio': f"{100.0 * patch_size / len(new_data):.2f}", 'generation_time_s': f"{generation_time:.3f}",
+            'apply_time_s': f"{apply_time:.3f}", 'verified': 'yes' if verified else 'no'}
+
+def read_baseline(baseline: str) -> dict:
+    with open(baseline, newline="") as baseline_file:
+        return {row['case']: int(row['patch_size']) for row in csv.DictReader(baseline_file)}
+
+def write_results(output: str, results: list) -> None:
+    with open(output, "w", newline="") as output_file:
+        writer = csv.DictWriter(output_file, fieldnames=CSV_FIELDS)
+        writer.writeheader()
+        writer.writerows(results)
+
+# Returns the list of cases whose patch grew by more than threshold % compared to the baseline
+def check_regressions(results: list, baseline: dict, threshold: float) -> list:
+    regressions = []
+    print(f"{'Case':<20} {'Baseline':>10} {'Patch size':>10} {'Change':>8}")
+    for result in results:
+        reference = baseline.get(result['case'])
+        if reference is None:
+            print(f"{result['case']:<20} {'-':>10} {result['patch_size']:>10} {'new':>8}")
+            continue
+        change = 100.0 * (result['patch_size'] - reference) / reference
+        print(f"{result['case']:<20} {reference:>10} {result['patch_size']:>10} {change:>+7.2f}%")
+        if change > threshold:
+            regressions.append(result['case'])
+    return regressions
+
+def main() -> None:
+    parser = argparse.ArgumentParser('Delta OTA Patch Size Benchmark')
+    parser.add_argument('--chip', help="Target", default="esp32")
+    parser.add_argument('--base_binary', help="Base binary of the release pair", default=DEFAULT_BASE_BINARY)
+    parser.add_argument('--new_binary', help="New binary of the release pair, also the base of the synthetic edits",
+                        default=DEFAULT_NEW_BINARY)
+    parser.add_argument('--output', help="CSV file where the results are written", default="bench_results.csv")
+    parser.add_argument('--baseline', help="CSV file of a previous run to compare the patch sizes with", default=DEFAULT_BASELINE)
+    parser.add_argument('--threshold', help="Allowed patch size growth compared to the baseline, in %%", type=float,
+                        default=DEFAULT_THRESHOLD)
+    parser.add_argument('--diff_mode', help="Diff mode passed to the generator", choices=patch_gen.DIFF_MODES, default='raw')
+    parser.add_argument('--optimize', help="Optimization goal passed to the generator", choices=patch_gen.OPTIMIZE_GOALS)
+    args = parser.parse_args()
+
+    try:
+        corpus = build_corpus(args.chip, args.base_binary, args.new_binary)
+    except (OSError, ValueError) as e:
+        print(f"Failed to build the benchmark corpus: {e}")
+        sys.exit(1)
+
+    results = []
+    for name, base_data, new_data in corpus:
+        print(f"Running {name}")
+        results.append(run_case(name, base_data, new_data, args.diff_mode, args.optimize))
+    write_results(args.output, results)
+    print(f"Results written to {args.output}")
+
+    failed = [result['case'] for result in results if result['verified'] != 'yes']
+    if failed:
+        print(f"Patch verification failed for: {', '.join(failed)}")
+        sys.exit(1)
+
+    if args.baseline and os.path.exists(args.baseline):
+        regressions = check_regressions(results, read_baseline(args.baseline), args.threshold)
+        if regressions:
+            print(f"Patch size regressed by more than {args.threshold}% for: {', '.join(regressions)}")
+            sys.exit(1)
+    else:
+        print("No baseline to compare with")
+
+if __name__ == '__main__':
+    main()
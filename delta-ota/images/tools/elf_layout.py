@@ -0,0 +1,133 @@
+#!/usr/bin/env python
+#
+# ELF layout tool. Records the address of every function and data object of a release ELF file, and compares the
+# layout of a new ELF file with it: which symbols moved, by how much, and where the first shift starts. A symbol that
+# moves changes every branch or literal referring to it, which inflates the delta patch between both releases.
+#
+# SPDX-FileCopyrightText: 2023 Espressif Systems (Shanghai) CO LTD
+# SPDX-License-Identifier: Apache-2.0
+
+import argparse
+import json
+import sys
+
+try:
+    from elftools.elf.elffile import ELFFile
+except ImportError:
+    print("Please install 'pyelftools'. Use command `pip install -r tools/requirements.txt`")
+    sys.exit(1)
+
+LAYOUT_VERSION = 1
+SYMBOL_TYPES = ('STT_FUNC', 'STT_OBJECT')
+
+# Reads the sections and the sized function/object symbols of an ELF file. Static symbols of the same name in several
+# files are told apart by their order of appearance in the symbol table (name, name#1, name#2...).
+def read_elf_layout(elf_file: str) -> dict:
+    sections = {}
+    symbols = {}
+    with open(elf_file, 'rb') as f:
+        elf = ELFFile(f)
+        for section in elf.iter_sections():
+            if section['sh_flags'] & 0x2: # SHF_ALLOC
+                sections[section.name] = [section['sh_addr'], section['sh_size']]
+        symtab = elf.get_section_by_name('.symtab')
+        if symtab is None:
+            raise ValueError(f"{elf_file} has no symbol table")
+        for symbol in symtab.iter_symbols():
+            if symbol['st_info']['type'] not in SYMBOL_TYPES or symbol['st_size'] == 0 or \
+                    not isinstance(symbol['st_shndx'], int):
+                continue
+            name = symbol.name
+            count = 1
+            while name in symbols:
+                name = f"{symbol.name}#{count}"
+                count += 1
+            symbols[name] = [elf.get_section(symbol['st_shndx']).name, symbol['st_value'], symbol['st_size']]
+    return {'version': LAYOUT_VERSION, 'sections': sections, 'symbols': symbols}
+
+# Loads a layout from a JSON file written by `record`, or from an ELF file
+def load_layout(file_name: str) -> dict:
+    if file_name.endswith('.json'):
+        with open(file_name) as f:
+            layout = json.load(f)
+        if layout.get('version') != LAYOUT_VERSION:
+            raise ValueError(f"{file_name} is not a layout file of version {LAYOUT_VERSION}")
+        return layout
+    return read_elf_layout(file_name)
+
+def record_layout(elf_file: str, output: str) -> None:
+    layout = read_elf_layout(elf_file)
+    with open(output, 'w') as f:
+        json.dump(layout, f, indent=1, sort_keys=True)
+        f.write("\n")
+    print(f"Recorded {len(layout['symbols'])} symbols of {len(layout['sections'])} sections to {output}")
+
+# Compares the symbol addresses of both layouts, per output section
+def compare_layouts(base: dict, new: dict) -> dict:
+    report = {}
+    for name, (section, address, size) in new['symbols'].items():
+        entry = report.setdefault(section, {'symbols': 0, 'added': 0, 'moved': 0, 'moved_bytes': 0, 'max_shift': 0,
+                                            'first_moved': None, 'resized': 0})
+        entry['symbols'] += 1
+        if name not in base['symbols']:
+            entry['added'] += 1
+            continue
+        base_section, base_address, base_size = base['symbols'][name]
+        if base_size != size:
+            entry['resized'] += 1
+        shift = address - base_address
+        if base_section != section or shift == 0:
+            continue
+        entry['moved'] += 1
+        entry['moved_bytes'] += size
+        entry['max_shift'] = max(entry['max_shift'], abs(shift))
+        if entry['first_moved'] is None or base_address < entry['first_moved'][1]:
+            entry['first_moved'] = (name, base_address, shift)
+    for name, (section, _, _) in base['symbols'].items():
+        if name not in new['symbols'] and section in report:
+            report[section]['removed'] = report[section].get('removed', 0) + 1
+    return report
+
+def print_report(report: dict) -> None:
+    print(f"{'Section':<24} {'Symbols':>7} {'Added':>6} {'Removed':>7} {'Resized':>7} {'Moved':>6} {'Moved bytes':>11} "
+          f"{'Max shift':>9}  First moved symbol")
+    total_moved = 0
+    for section, entry in sorted(report.items()):
+        first_moved = ""
+        if entry['first_moved']:
+            name, address, shift = entry['first_moved']
+            first_moved = f"{name} (0x{address:08x}, {shift:+d})"
+        print(f"{section:<24} {entry['symbols']:>7} {entry['added']:>6} {entry.get('removed', 0):>7} {entry['resized']:>7} "
+              f"{entry['moved']:>6} {entry['moved_bytes']:>11} {entry['max_shift']:>9}  {first_moved}")
+        total_moved += entry['moved_bytes']
+    print(f"{total_moved} bytes of code and data moved")
+
+def main() -> None:
+    if len(sys.argv) < 2:
+        print("Usage: python elf_layout.py record/compare [arguments]")
+        sys.exit(1)
+
+    command = sys.argv[1]
+    parser = argparse.ArgumentParser('ELF Layout Tool')
+
+    if command == 'record':
+        parser.add_argument('--elf', help="ELF file of the release", required=True)
+        parser.add_argument('--output', help="Layout file to write", default="layout.json")
+        args = parser.parse_args(sys.argv[2:])
+        record_layout(args.elf, args.output)
+    elif command == 'compare':
+        parser.add_argument('--base', help="Layout file or ELF file of the previous release", required=True)
+        parser.add_argument('--new', help="Layout file or ELF file of the new release", required=True)
+        args = parser.parse_args(sys.argv[2:])
+        try:
+            report = compare_layouts(load_layout(args.base), load_layout(args.new))
+        except (OSError, ValueError) as e:
+            print(f"Failed to read layout: {e}")
+            sys.exit(1)
+        print_report(report)
+    else:
+        print("Invalid command. Use 'record' or 'compare'.")
+        sys.exit(1)
+
+if __name__ == '__main__':
+    main()
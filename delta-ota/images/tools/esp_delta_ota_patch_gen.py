@@ -7,19 +7,34 @@
 # SPDX-License-Identifier: Apache-2.0
 
 import argparse
+import datetime
+import io
+import json
+import multiprocessing
 import os
 import re
+import shutil
+import struct
 import tempfile
 import hashlib
 import sys
-import esptool
+import time
+from esptool.targets import CHIP_DEFS
 
 try:
     import detools
+    from detools import bsdiff
+    from detools.common import (PATCH_TYPE_IN_PLACE, PATCH_TYPE_SEQUENTIAL, PATCH_TYPES, compression_string_to_number,
+                                pack_size, peek_header_type, unpack_size_bytes)
+    from detools.create import create_compressor, pack_header
+    from detools.info import patch_info
+    from detools.suffix_array import divsufsort
 except ImportError:
     print("Please install 'detools'. Use command `pip install -r tools/requirements.txt`")
     sys.exit(1)
 
+TOOL_VERSION = "1.5.0" # Part of the patch cache key, bump it whenever the generated patch format changes
+
 # Magic Byte is created using command: echo -n "esp_delta_ota" | sha256sum
 esp_delta_ota_magic = 0xfccdde10
 
@@ -28,91 +43,778 @@ DIGEST_SIZE = 32 # This is the SHA256 of the base binary
 HEADER_SIZE = 64
 RESERVED_HEADER = HEADER_SIZE - (MAGIC_SIZE + DIGEST_SIZE) # This is the reserved header size
 
+# The reserved header bytes carry a summary of the patch, so that a device can decide whether to download the patch
+# from its first 64 bytes: header version, compression, patch type (detools numbering, 0 is sequential), reserved,
+# target size, patch body size and the first bytes of the validation hash of the target image. A header version of 0
+# means that the fields are not set.
+PATCH_INFO_VERSION = 1
+PATCH_INFO_FORMAT = "<BBBBII16s"
+PATCH_INFO_TARGET_DIGEST_SIZE = 16
+
+PATCH_COMPRESSION = 'heatshrink'
+HEATSHRINK_WINDOW_SZ2 = 8 # detools defaults, the device side decoder is built with the same parameters
+HEATSHRINK_LOOKAHEAD_SZ2 = 7
+
+DEFAULT_CACHE_MAX_SIZE = 1024 # MB
+
+# ESP app image layout (esp_image_header_t and esp_image_segment_header_t in esp_app_format.h)
+ESP_IMAGE_HEADER_MAGIC = 0xE9
+IMAGE_HEADER_SIZE = 24
+SEGMENT_HEADER_SIZE = 8
+CHECKSUM_MAGIC = 0xEF
+IMAGE_HASH_APPENDED_OFFSET = 23
+
+HASH_BLOCK_SIZE = 1024 * 1024
+
+# esp_app_desc_t, stored at the beginning of the first segment of the image
+APP_DESC_MAGIC_WORD = 0xABCD5432
+APP_DESC_FORMAT = "<II8x32s32s16s16s32s32s"
+# (offset, size) of the esp_app_desc_t fields that change with every build even when the code does not
+APP_DESC_BUILD_INFO_FIELDS = {'version': (16, 32), 'time': (80, 16), 'date': (96, 16), 'idf_ver': (112, 32),
+                              'app_elf_sha256': (144, 32)}
+# Source file paths embedded in the image (assert messages, logs). They change when the project is built from another
+# directory, unless the build maps them to fixed prefixes (/IDF, /IDF_PROJECT, ...)
+BUILD_PATH_PATTERN = re.compile(rb'(?:[A-Za-z]:)?(?:[/\\][\w.+-]+){2,}\.(?:c|cpp|h|hpp|S|inc)\b')
+
+DIFF_MODES = ['raw', 'segments', 'auto']
+
+# In-place patches rebuild the new image inside the partition that holds the base image, for devices with a single
+# app slot. memory_size is the size of that partition, and the patch is applied segment_size bytes at a time, each
+# segment being erased once (so it must be a multiple of the flash sector size).
+PATCH_TYPE_NAMES = ['sequential', 'in-place']
+DEFAULT_SEGMENT_SIZE = 0x10000
+
+# Optimization goals of --optimize, and the compressions it tries. The detools library of esp_delta_ota is only built
+# with heatshrink, and the device rejects patches with another compression. Add a compression here only together with
+# its support in the device build (and in verify_patch_header() of delta_ota.c).
+OPTIMIZE_GOALS = ['size', 'apply-time', 'balanced']
+OPTIMIZE_COMPRESSIONS = ['heatshrink']
+
+# Device side apply cost model. These are rough figures for an ESP32 at 240 MHz with a 40 MHz QIO flash, only their
+# ratios matter when ranking the patch candidates. The write of the new image (about 12 us per byte, including the
+# sector erase) is the same for every candidate, so it is left out.
+COST_SOURCE_READ_US_PER_BYTE = 0.1 # esp_partition_read() of the base image
+COST_SOURCE_SEEK_US = 20.0 # Every non zero adjustment starts a new read_cb() at another offset
+COST_DECOMPRESS_US_PER_BYTE = {'heatshrink': 0.3} # Per decompressed patch stream byte, see OPTIMIZE_COMPRESSIONS
+COST_MARGIN = 0.05 # Candidates whose estimated times are within this fraction of the best one are equal, the smallest wins
+BALANCED_LINK_SPEED = 20 # KB/s, link speed used to weigh the transfer time against the apply time in 'balanced'
+SMALL_REGION_SIZE = 64 # Regions up to this size are diffed byte by byte instead of with bsdiff
+
+# Device side I/O model of simulate_patch. The detools C library streams diff and extra data through fixed size
+# buffers, so every read_cb() and write_cb() call of esp_delta_ota is at most DEVICE_APPLY_BUFFER_SIZE bytes.
+DEVICE_APPLY_BUFFER_SIZE = 128
+FLASH_SECTOR_SIZE = 4096
+
 def calculate_sha256(file_path: str) -> str:
     """Calculate the SHA-256 hash of a file."""
     sha256_hash = hashlib.sha256()
     
     with open(file_path, "rb") as f:
         # Read the file in chunks to avoid memory issues for large files
-        for byte_block in iter(lambda: f.read(4096), b""):
+        for byte_block in iter(lambda: f.read(HASH_BLOCK_SIZE), b""):
             sha256_hash.update(byte_block)
     
     # Return the hex representation of the hash
     return sha256_hash.hexdigest()
 
-def create_patch(chip: str, base_binary: str, new_binary: str, patch_file_name: str) -> None:
-    command = ['--chip', chip, 'image_info', base_binary]
-    output = sys.stdout
-    sys.stdout = tempfile.TemporaryFile(mode='w+')
+class HashWriter:
+    """File-like sink that only hashes what is written to it."""
+    def __init__(self) -> None:
+        self.sha256_hash = hashlib.sha256()
+        self.size = 0
+
+    def write(self, data: bytes) -> int:
+        self.sha256_hash.update(data)
+        self.size += len(data)
+        return len(data)
+
+class ImageSegment:
+    def __init__(self, index: int, load_addr: int, header_offset: int, data_len: int) -> None:
+        self.index = index
+        self.load_addr = load_addr
+        self.header_offset = header_offset
+        self.data_offset = header_offset + SEGMENT_HEADER_SIZE
+        self.data_len = data_len
+
+class ImageLayout:
+    def __init__(self, segments: list, segments_end: int, checksum_offset: int) -> None:
+        self.segments = segments
+        self.segments_end = segments_end
+        self.checksum_offset = checksum_offset
+
+# Walks the segment headers of an ESP app image and checks the image checksum
+def parse_image(image: bytes) -> ImageLayout:
+    if len(image) < IMAGE_HEADER_SIZE or image[0] != ESP_IMAGE_HEADER_MAGIC:
+        raise ValueError("invalid image header magic")
+
+    segments = []
+    offset = IMAGE_HEADER_SIZE
+    checksum = CHECKSUM_MAGIC
+    for index in range(image[1]):
+        if offset + SEGMENT_HEADER_SIZE > len(image):
+            raise ValueError("truncated segment header")
+        load_addr, data_len = struct.unpack_from("<II", image, offset)
+        segment = ImageSegment(index, load_addr, offset, data_len)
+        for word in struct.iter_unpack("<I", image[segment.data_offset:segment.data_offset + (data_len & ~3)]):
+            checksum ^= word[0]
+        for byte in image[segment.data_offset + (data_len & ~3):segment.data_offset + data_len]:
+            checksum ^= byte
+        segments.append(segment)
+        offset = segment.data_offset + data_len
+    # The checksum byte is placed so that the image is 16 byte aligned after it
+    checksum_offset = (offset | 15)
+    if checksum_offset >= len(image):
+        raise ValueError("truncated image")
+    checksum = (checksum ^ (checksum >> 16)) & 0xFFFF
+    checksum = (checksum ^ (checksum >> 8)) & 0xFF
+    if image[checksum_offset] != checksum:
+        raise ValueError("invalid image checksum")
+    return ImageLayout(segments, offset, checksum_offset)
+
+# Returns the validation hash (the SHA-256 appended after the checksum) of an ESP app image. This is the value
+# esp_partition_get_sha256() reports on the device for the running partition.
+def get_validation_hash(chip: str, image: bytes) -> bytes:
+    layout = parse_image(image)
+    chip_id = struct.unpack_from("<H", image, 12)[0]
+    expected_chip_id = getattr(CHIP_DEFS[chip], "IMAGE_CHIP_ID", None)
+    if expected_chip_id is not None and chip_id != expected_chip_id:
+        raise ValueError(f"image is for chip id {chip_id}, not {chip}")
+    if image[IMAGE_HASH_APPENDED_OFFSET] != 1:
+        raise ValueError("image has no appended SHA-256")
+
+    hashed_size = layout.checksum_offset + 1
+    if hashed_size + DIGEST_SIZE > len(image):
+        raise ValueError("truncated image")
+    digest = image[hashed_size:hashed_size + DIGEST_SIZE]
+    if hashlib.sha256(image[:hashed_size]).digest() != digest:
+        raise ValueError("invalid validation hash")
+    return digest
+
+# Returns the esp_app_desc_t fields of an ESP app image as a dict
+def get_app_desc(image: bytes) -> dict:
+    layout = parse_image(image)
+    if not layout.segments:
+        raise ValueError("image has no segment")
+    offset = layout.segments[0].data_offset
+    if offset + struct.calcsize(APP_DESC_FORMAT) > len(image):
+        raise ValueError("truncated app description")
+    fields = struct.unpack_from(APP_DESC_FORMAT, image, offset)
+    if fields[0] != APP_DESC_MAGIC_WORD:
+        raise ValueError("invalid app description magic word")
+    text = [field.split(b"\0", 1)[0].decode(errors="replace") for field in fields[2:7]]
+    return {'secure_version': fields[1], 'version': text[0], 'project_name': text[1], 'time': text[2], 'date': text[3],
+            'idf_ver': text[4], 'app_elf_sha256': fields[7].hex()}
+
+def pack_patch_info(patch_body: bytes, new_data: bytes, new_validation_hash: bytes) -> bytes:
+    patch_type, info = patch_info(io.BytesIO(patch_body))
+    return struct.pack(PATCH_INFO_FORMAT, PATCH_INFO_VERSION, compression_string_to_number(info[1]), PATCH_TYPES[patch_type],
+                       0, len(new_data), len(patch_body), new_validation_hash[:PATCH_INFO_TARGET_DIGEST_SIZE])
+
+def manifest_file_name(patch_file_name: str) -> str:
+    return os.path.splitext(patch_file_name)[0] + ".json"
+
+# Writes the JSON manifest of a patch next to it, with the same information the patch header carries plus
+# what a server needs to select the patch for a device
+def write_manifest(chip: str, base_data: bytes, new_data: bytes, patch_file_name: str, churn: dict = None) -> None:
+    with open(patch_file_name, "rb") as patch_file:
+        patch = patch_file.read()
+    patch_type, info = patch_info(io.BytesIO(patch[HEADER_SIZE:]))
+    try:
+        app_desc = get_app_desc(new_data)
+    except ValueError as e:
+        print(f"Failed to read the app description of the new binary: {e}")
+        app_desc = {}
+    manifest = {
+        'chip': chip,
+        'base_sha256': hashlib.sha256(base_data).hexdigest(),
+        'base_validation_hash': patch[MAGIC_SIZE:MAGIC_SIZE + DIGEST_SIZE].hex(),
+        'target_sha256': hashlib.sha256(new_data).hexdigest(),
+        'target_size': len(new_data),
+        'target_version': app_desc.get('version'),
+        'target_project_name': app_desc.get('project_name'),
+        'target_secure_version': app_desc.get('secure_version'),
+        'patch_size': len(patch),
+        'patch_sha256': hashlib.sha256(patch).hexdigest(),
+        'patch_type': patch_type,
+        'compression': info[1],
+        'generated_at': datetime.datetime.now(datetime.timezone.utc).isoformat(timespec='seconds'),
+        'tool_version': TOOL_VERSION,
+    }
+    if churn:
+        manifest['non_code_churn'] = churn
+    if patch_type == 'in-place':
+        manifest['memory_size'] = info[3]
+        manifest['segment_size'] = info[4]
+    write_file_atomic(manifest_file_name(patch_file_name), (json.dumps(manifest, indent=4) + "\n").encode())
+
+# Applies the patch body in memory and compares the SHA-256 of the result, as it is streamed out, with new_sha256.
+# An in-place patch is applied to a copy of the partition (the base image followed by erased flash).
+def verify_patch_data(base_data: bytes, patch_body: bytes, new_sha256: str) -> bool:
+    new_created_binary = HashWriter()
     try:
-        esptool.main(command)
-        sys.stdout.seek(0)
-        content = sys.stdout.read()
+        if peek_header_type(io.BytesIO(patch_body)) == PATCH_TYPE_IN_PLACE:
+            _, info = patch_info(io.BytesIO(patch_body))
+            memory = io.BytesIO(base_data + b"\xff" * (info[3] - len(base_data)))
+            to_size = detools.apply_patch_in_place(memory, io.BytesIO(patch_body))
+            new_created_binary.write(memory.getvalue()[:to_size])
+        else:
+            detools.apply_patch(io.BytesIO(base_data), io.BytesIO(patch_body), new_created_binary)
     except Exception as e:
-        print(f"Error during esptool command execution: {e}")
-    finally:
-        sys.stdout.close()
-        sys.stdout = output
+        print(f"Failed to apply patch: {e}")
+        return False
+    return new_created_binary.sha256_hash.hexdigest() == new_sha256
 
-    x = re.search(r"Validation Hash: ([A-Za-z0-9]+) \(valid\)", content)
-    
-    if x is None:
-        print("Failed to find validation hash in base binary.")
+# Writes the file under a unique temporary name and renames it, so that readers never see a partial file
+def write_file_atomic(file_name: str, data: bytes) -> None:
+    with tempfile.NamedTemporaryFile(dir=os.path.dirname(os.path.abspath(file_name)), delete=False) as f:
+        f.write(data)
+    os.chmod(f.name, 0o644) # NamedTemporaryFile creates the file readable by the owner only
+    os.replace(f.name, file_name)
+
+# The suffix array of the base binary is what dominates the patch generation time. It only depends on the
+# base binary, so it is cached on disk (keyed by the SHA-256 of the base) and reused for every new binary
+# patched against the same base.
+def load_base_index(base_data: bytes, cache_dir: str) -> bytearray:
+    index_size = 4 * (len(base_data) + 1)
+    index_dir = os.path.join(cache_dir, "base_index")
+    index_file = os.path.join(index_dir, hashlib.sha256(base_data).hexdigest() + ".sa")
+
+    if os.path.exists(index_file) and os.path.getsize(index_file) == index_size:
+        os.utime(index_file) # Mark as recently used for the cache eviction
+        with open(index_file, "rb") as f:
+            return bytearray(f.read())
+
+    suffix_array = bytearray(index_size)
+    divsufsort(base_data, suffix_array)
+
+    os.makedirs(index_dir, exist_ok=True)
+    # Concurrent generators never see a partial index
+    write_file_atomic(index_file, suffix_array)
+    return suffix_array
+
+# Runs bsdiff and returns its output as [diff, extra, adjustment] chunks
+def bsdiff_chunks(suffix_array: bytearray, from_data: bytes, to_data: bytes) -> list:
+    chunks = []
+    packed_chunks = bsdiff.create_patch(suffix_array, from_data, to_data, bytearray(len(to_data) + 1))
+    for i in range(0, len(packed_chunks), 5):
+        chunks.append([packed_chunks[i + 1], packed_chunks[i + 3], unpack_size_bytes(packed_chunks[i + 4])])
+    return chunks
+
+# Suffix array of the base binary, taken from the cache when enabled
+def base_index(base_data: bytes, cache_dir: str) -> bytearray:
+    if cache_dir:
+        return load_base_index(base_data, cache_dir)
+    suffix_array = bytearray(4 * (len(base_data) + 1))
+    divsufsort(base_data, suffix_array)
+    return suffix_array
+
+# Chunks of the raw diff of both binaries
+def create_raw_chunks(base_data: bytes, new_data: bytes, cache_dir: str) -> list:
+    return bsdiff_chunks(base_index(base_data, cache_dir), base_data, new_data)
+
+# Splits an image in the regions that are diffed against each other: the image header, every segment header and
+# segment data, and the trailer (padding, checksum and appended SHA-256). Segment data is identified by its load
+# address, so that a segment is diffed against the same segment of the base image even when the segments in
+# front of it changed size.
+def image_regions(image_size: int, layout: ImageLayout) -> list:
+    regions = [("header", 0, IMAGE_HEADER_SIZE)]
+    for segment in layout.segments:
+        regions.append((("segment_header", segment.index), segment.header_offset, segment.data_offset))
+        regions.append((("segment", segment.load_addr), segment.data_offset, segment.data_offset + segment.data_len))
+    regions.append(("trailer", layout.segments_end, image_size))
+    return regions
+
+# Builds the (diff, extra, adjustment) chunks of a sequential patch region by region. The chunks of all regions
+# form a single regular detools sequential patch, so the device applies it exactly like a raw patch.
+def create_segment_chunks(base_data: bytes, new_data: bytes) -> list:
+    base_layout = parse_image(base_data)
+    base_regions = {}
+    base_segments_by_index = {}
+    for key, start, end in image_regions(len(base_data), base_layout):
+        base_regions[key] = (start, end)
+    for segment in base_layout.segments:
+        base_segments_by_index[segment.index] = (segment.data_offset, segment.data_offset + segment.data_len)
+
+    chunks = []
+    from_pos = 0
+    for index, (key, start, end) in enumerate(image_regions(len(new_data), parse_image(new_data))):
+        to_region = new_data[start:end]
+        from_range = base_regions.get(key)
+        if from_range is None and key[0] == "segment":
+            # The load address moved, fall back to the segment at the same position
+            from_range = base_segments_by_index.get((index - 1) // 2)
+        if from_range is None or from_range[0] == from_range[1]:
+            chunks.append([b"", to_region, 0])
+            continue
+
+        # Move the from pointer to the start of the matching base region
+        seek = from_range[0] - from_pos
+        if chunks:
+            chunks[-1][2] += seek
+        elif seek != 0:
+            chunks.append([b"", b"", seek])
+        from_pos = from_range[0]
+        from_region = base_data[from_range[0]:from_range[1]]
+
+        if len(to_region) <= SMALL_REGION_SIZE or len(from_region) <= SMALL_REGION_SIZE:
+            size = min(len(to_region), len(from_region))
+            diff = bytes((to_byte - from_byte) & 0xFF for to_byte, from_byte in zip(to_region[:size], from_region[:size]))
+            chunks.append([diff, to_region[size:], 0])
+            from_pos += size
+            continue
+
+        suffix_array = bytearray(4 * (len(from_region) + 1))
+        divsufsort(from_region, suffix_array)
+        for diff, extra, adjustment in bsdiff_chunks(suffix_array, from_region, to_region):
+            chunks.append([diff, extra, adjustment])
+            from_pos += len(diff) + adjustment
+    return chunks
+
+# Estimates how many bytes of the patch come from non-code churn: the build information of esp_app_desc_t and the
+# trailer (checksum and SHA-256) of the image, which change with every build. The new image is normalized step by step
+# (build information copied from the base, then the trailer too) and the raw bsdiff patch size measured after each
+# step. Build paths that are in only one of the images are listed too, they cannot be normalized as they move code.
+# This takes three more bsdiff runs, so it is only done with --report_churn.
+def estimate_churn(base_data: bytes, new_data: bytes, cache_dir: str) -> dict:
+    base_layout = parse_image(base_data)
+    new_layout = parse_image(new_data)
+    get_app_desc(base_data)
+    get_app_desc(new_data)
+
+    suffix_array = base_index(base_data, cache_dir)
+
+    def patch_size(to_data: bytes) -> int:
+        patch_body = io.BytesIO()
+        write_sequential_patch(bsdiff_chunks(suffix_array, base_data, to_data), len(to_data), patch_body)
+        return len(patch_body.getvalue())
+
+    normalized = bytearray(new_data)
+    base_desc = base_layout.segments[0].data_offset
+    new_desc = new_layout.segments[0].data_offset
+    for offset, size in APP_DESC_BUILD_INFO_FIELDS.values():
+        normalized[new_desc + offset:new_desc + offset + size] = base_data[base_desc + offset:base_desc + offset + size]
+    build_info_normalized = bytes(normalized)
+    trailer_size = 1 + DIGEST_SIZE if new_data[IMAGE_HASH_APPENDED_OFFSET] == 1 else 1
+    normalized[new_layout.checksum_offset:new_layout.checksum_offset + trailer_size] = \
+        base_data[base_layout.checksum_offset:base_layout.checksum_offset + trailer_size]
+
+    size = patch_size(new_data)
+    size_without_build_info = patch_size(build_info_normalized)
+    size_without_churn = patch_size(bytes(normalized))
+    base_paths = set(BUILD_PATH_PATTERN.findall(base_data))
+    new_paths = set(BUILD_PATH_PATTERN.findall(new_data))
+    return {'patch_size': size, 'build_info_bytes': max(size - size_without_build_info, 0),
+            'trailer_bytes': max(size_without_build_info - size_without_churn, 0),
+            'changed_build_paths': sorted(path.decode(errors="replace") for path in base_paths ^ new_paths)}
+
+def print_churn(churn: dict) -> None:
+    churn_bytes = churn['build_info_bytes'] + churn['trailer_bytes']
+    print(f"Non-code churn: {churn_bytes} of {churn['patch_size']} bytes ({100.0 * churn_bytes / churn['patch_size']:.1f}%) "
+          f"of the raw patch: app description {churn['build_info_bytes']}, image trailer {churn['trailer_bytes']}")
+    if churn['changed_build_paths']:
+        print(f"Build paths in only one of the images: {len(churn['changed_build_paths'])}, "
+              f"e.g. {churn['changed_build_paths'][0]} (see the reproducible build mode)")
+
+# Estimates and prints the non-code churn, returns None when it cannot be estimated. The churn does not depend on
+# the patch, so it is also reported for a patch taken from the cache.
+def report_non_code_churn(base_data: bytes, new_data: bytes, cache_dir: str) -> dict:
+    try:
+        churn = estimate_churn(base_data, new_data, cache_dir)
+    except ValueError as e:
+        print(f"Non-code churn not estimated: {e}")
+        return None
+    print_churn(churn)
+    return churn
+
+# Same output as detools.create_patch() for a sequential patch, but from already computed chunks
+def write_sequential_patch(chunks: list, to_size: int, p_binary, compression: str = PATCH_COMPRESSION) -> None:
+    compressor = create_compressor(compression, HEATSHRINK_WINDOW_SZ2, HEATSHRINK_LOOKAHEAD_SZ2)
+    p_binary.write(pack_header(PATCH_TYPE_SEQUENTIAL, compression_string_to_number(compression)))
+    p_binary.write(pack_size(to_size))
+    if to_size == 0:
         return
-    patch_file_without_header = "patch_file_temp.bin"
+    p_binary.write(compressor.compress(pack_size(0))) # No data format patch
+    for diff, extra, adjustment in chunks:
+        p_binary.write(compressor.compress(pack_size(len(diff)) + diff + pack_size(len(extra)) + extra + pack_size(adjustment)))
+    p_binary.write(compressor.flush())
+
+# Estimates the part of the apply time on the device that differs between patches of the same image: the time to
+# decompress the patch stream, read the source (base) data and seek in the source. See the COST_* constants.
+def estimate_apply_cost(patch_body: bytes) -> dict:
+    _, info = patch_info(io.BytesIO(patch_body))
+    compression, to_size, diff_sizes, extra_sizes, adjustment_sizes, size_bytes = (info[1], *info[6:])
+    source_bytes = sum(diff_sizes)
+    seeks = sum(1 for adjustment in adjustment_sizes if adjustment != 0)
+    stream_bytes = source_bytes + sum(extra_sizes) + size_bytes
+    apply_us = (source_bytes * COST_SOURCE_READ_US_PER_BYTE + seeks * COST_SOURCE_SEEK_US +
+                stream_bytes * COST_DECOMPRESS_US_PER_BYTE[compression])
+    return {'source_bytes': source_bytes, 'seeks': seeks, 'written_bytes': to_size, 'stream_bytes': stream_bytes,
+            'apply_us': apply_us}
+
+# Ranks the candidates for the goal. The time estimates are rough, so the candidates within COST_MARGIN of the best
+# estimate are taken as equal and the smallest of them is ranked first.
+def rank_candidates(scored: list, goal: str) -> list:
+    scored.sort(key=lambda candidate: candidate[0])
+    if goal == 'size':
+        return scored
+    limit = scored[0][0][0] * (1 + COST_MARGIN)
+    tied = sorted((candidate for candidate in scored if candidate[0][0] <= limit), key=lambda candidate: len(candidate[3]))
+    return tied + [candidate for candidate in scored if candidate[0][0] > limit]
+
+def patch_score(patch_body: bytes, cost: dict, goal: str) -> tuple:
+    transfer_us = len(patch_body) * 1000000 / (BALANCED_LINK_SPEED * 1024)
+    if goal == 'apply-time':
+        return (cost['apply_us'], len(patch_body))
+    if goal == 'balanced':
+        return (transfer_us + cost['apply_us'], len(patch_body))
+    return (len(patch_body), cost['apply_us'])
+
+# Creates the patch body (without the esp_delta_ota header).
+# diff_mode selects between diffing the images as raw byte arrays (the default), diffing them segment by segment, or
+# trying both.
+# Without optimize, the patch is heatshrink compressed and the smallest candidate is kept. With optimize, every
+# diff algorithm and compression usable by the device is tried and the best candidate for the goal is kept.
+def create_patch_body(base_data: bytes, new_data: bytes, cache_dir: str, diff_mode: str, optimize: str = None) -> bytes:
+    chunk_sets = []
+    if diff_mode in ('raw', 'auto'):
+        chunk_sets.append(("bsdiff", create_raw_chunks(base_data, new_data, cache_dir)))
+    if diff_mode in ('segments', 'auto'):
+        try:
+            chunk_sets.append(("bsdiff-segments", create_segment_chunks(base_data, new_data)))
+        except ValueError as e:
+            if diff_mode == 'segments':
+                raise
+            print(f"Segment-aware diff not possible ({e}), using the raw diff")
+
+    compressions = OPTIMIZE_COMPRESSIONS if optimize else [PATCH_COMPRESSION]
+    candidates = []
+    for compression in compressions:
+        for algorithm, chunks in chunk_sets:
+            patch_body = io.BytesIO()
+            write_sequential_patch(chunks, len(new_data), patch_body, compression)
+            candidates.append((algorithm, compression, patch_body.getvalue()))
+        if optimize and diff_mode != 'segments':
+            patch_body = io.BytesIO()
+            detools.create_patch(io.BytesIO(base_data), io.BytesIO(new_data), patch_body, compression=compression,
+                                 algorithm='match-blocks', use_mmap=False)
+            candidates.append(("match-blocks", compression, patch_body.getvalue()))
+
+    goal = optimize if optimize else 'size'
+    scored = []
+    for algorithm, compression, patch_body in candidates:
+        cost = estimate_apply_cost(patch_body)
+        scored.append((patch_score(patch_body, cost, goal), algorithm, compression, patch_body, cost))
+    scored = rank_candidates(scored, goal)
+
+    if len(scored) > 1:
+        # The estimate leaves out the write of the new image, the same for every candidate
+        print(f"{'Algorithm':<16} {'Compression':<11} {'Patch size':>10} {'Seeks':>6} {'Source read':>11} {'Est. read+decode (ms)':>21}")
+        for _, algorithm, compression, patch_body, cost in scored:
+            print(f"{algorithm:<16} {compression:<11} {len(patch_body):>10} {cost['seeks']:>6} {cost['source_bytes']:>11} "
+                  f"{cost['apply_us'] / 1000:>21.1f}")
+        print(f"Selected {scored[0][1]} with {scored[0][2]} compression (goal: {goal})")
+    return scored[0][3]
+
+# Creates the body of an in-place patch. detools splits the new image in segments and diffs each of them against
+# the part of the base image that is still intact when the segment is written, so the diff modes do not apply.
+def create_in_place_patch_body(base_data: bytes, new_data: bytes, memory_size: int, segment_size: int) -> bytes:
+    if segment_size % FLASH_SECTOR_SIZE != 0:
+        raise ValueError(f"segment size {segment_size} is not a multiple of the flash sector size")
+    if max(len(base_data), len(new_data)) > memory_size:
+        raise ValueError(f"images do not fit in a memory of {memory_size} bytes")
+    patch_body = io.BytesIO()
+    detools.create_patch(io.BytesIO(base_data), io.BytesIO(new_data), patch_body, compression=PATCH_COMPRESSION,
+                         patch_type='in-place', memory_size=memory_size, segment_size=segment_size, use_mmap=False,
+                         heatshrink_window_sz2=HEATSHRINK_WINDOW_SZ2, heatshrink_lookahead_sz2=HEATSHRINK_LOOKAHEAD_SZ2)
+    return patch_body.getvalue()
+
+# Patches are cached by content: the key covers everything the patch depends on (base and new binaries,
+# codec and generator versions), so a cached patch can be returned without rebuilding or re-verifying it.
+def patch_cache_key(base_sha256: str, new_sha256: str, diff_mode: str, optimize: str, in_place: tuple = None) -> str:
+    codec = f"{optimize or PATCH_COMPRESSION}-{HEATSHRINK_WINDOW_SZ2}-{HEATSHRINK_LOOKAHEAD_SZ2}"
+    if in_place:
+        codec += f"-in-place-{in_place[0]}-{in_place[1]}"
+    key = f"{base_sha256}:{new_sha256}:{codec}:{diff_mode}:{TOOL_VERSION}:detools-{detools.__version__}"
+    return hashlib.sha256(key.encode()).hexdigest()
+
+def lookup_cached_patch(cache_dir: str, key: str, patch_file_name: str) -> bool:
+    cached_patch = os.path.join(cache_dir, "patches", key + ".bin")
+    if not os.path.exists(cached_patch):
+        return False
+    shutil.copyfile(cached_patch, patch_file_name)
+    os.utime(cached_patch) # Mark as recently used for the eviction
+    return True
+
+def store_cached_patch(cache_dir: str, key: str, patch_file_name: str, cache_max_size: int) -> None:
+    patches_dir = os.path.join(cache_dir, "patches")
+    os.makedirs(patches_dir, exist_ok=True)
+    with open(patch_file_name, 'rb') as f:
+        write_file_atomic(os.path.join(patches_dir, key + ".bin"), f.read())
+    evict_cache(cache_dir, cache_max_size * 1024 * 1024)
+
+# Removes the least recently used entries (patches and base indexes) until the cache fits in max_size bytes
+def evict_cache(cache_dir: str, max_size: int) -> None:
+    entries = []
+    for sub_dir in ("patches", "base_index"):
+        path = os.path.join(cache_dir, sub_dir)
+        if not os.path.isdir(path):
+            continue
+        for name in os.listdir(path):
+            try:
+                stat = os.stat(os.path.join(path, name))
+            except FileNotFoundError: # Removed by a concurrent generator
+                continue
+            entries.append((stat.st_mtime, stat.st_size, os.path.join(path, name)))
+
+    total_size = sum(entry[1] for entry in entries)
+    for _, size, path in sorted(entries):
+        if total_size <= max_size:
+            break
+        try:
+            os.remove(path)
+        except FileNotFoundError:
+            pass
+        total_size -= size
+
+def create_patch(chip: str, base_binary: str, new_binary: str, patch_file_name: str, cache_dir: str = None,
+                 cache_max_size: int = DEFAULT_CACHE_MAX_SIZE, diff_mode: str = 'raw', optimize: str = None,
+                 patch_type: str = 'sequential', memory_size: int = None, segment_size: int = DEFAULT_SEGMENT_SIZE,
+                 report_churn: bool = False) -> bool:
+    in_place = (memory_size, segment_size) if patch_type == 'in-place' else None
+    if in_place and not memory_size:
+        print("The memory size (size of the app partition) is required for in-place patches")
+        return False
+
+    with open(base_binary, 'rb') as b_binary, open(new_binary, 'rb') as n_binary:
+        base_data = b_binary.read()
+        new_data = n_binary.read()
+    new_sha256 = hashlib.sha256(new_data).hexdigest()
+
+    # Checked before the cache lookup, so that a cached patch is never returned for images of another chip
+    try:
+        validation_hash = get_validation_hash(chip, base_data)
+    except ValueError as e:
+        print(f"Failed to find validation hash in base binary: {e}")
+        return False
+    try:
+        new_validation_hash = get_validation_hash(chip, new_data)
+    except ValueError as e:
+        print(f"Failed to find validation hash in new binary: {e}")
+        return False
+
+    if cache_dir:
+        key = patch_cache_key(hashlib.sha256(base_data).hexdigest(), new_sha256, diff_mode, optimize, in_place)
+        if lookup_cached_patch(cache_dir, key, patch_file_name):
+            print("Patch found in cache.")
+            churn = report_non_code_churn(base_data, new_data, cache_dir) if report_churn else None
+            write_manifest(chip, base_data, new_data, patch_file_name, churn)
+            return True
+
     try:
-        with open(base_binary, 'rb') as b_binary, open(new_binary, 'rb') as n_binary, open(patch_file_without_header, 'wb') as p_binary:
-            detools.create_patch(b_binary, n_binary, p_binary, compression='heatshrink') # b_binary is the base binary, n_binary is the new binary, p_binary is the patch file without header
-
-        with open(patch_file_without_header, "rb") as p_binary, open(patch_file_name, "wb") as patch_file:
-            patch_file.write(esp_delta_ota_magic.to_bytes(MAGIC_SIZE, 'little'))
-            patch_file.write(bytes.fromhex(x[1]))
-            patch_file.write(bytearray(RESERVED_HEADER))
-            patch_file.write(p_binary.read())    
+        if in_place:
+            patch_body = create_in_place_patch_body(base_data, new_data, *in_place)
+        else:
+            patch_body = create_patch_body(base_data, new_data, cache_dir, diff_mode, optimize)
+        header = (esp_delta_ota_magic.to_bytes(MAGIC_SIZE, 'little') + validation_hash +
+                  pack_patch_info(patch_body, new_data, new_validation_hash))
+        write_file_atomic(patch_file_name, header + patch_body)
     except Exception as e:
         print(f"Error during patch creation: {e}")
-    finally:
-        if os.path.exists(patch_file_without_header):
-            os.remove(patch_file_without_header)
+        return False
 
     print("Patch created successfully.")
-    # Verifying the created patch file
-    verify_patch(base_binary, patch_file_name, new_binary)
+    # Verifying the created patch
+    if not verify_patch_data(base_data, patch_body, new_sha256):
+        print("Failed to verify the patch")
+        return False
+    print("Patch file verified successfully")
+    churn = report_non_code_churn(base_data, new_data, cache_dir) if report_churn else None
+    write_manifest(chip, base_data, new_data, patch_file_name, churn)
+    if cache_dir:
+        store_cached_patch(cache_dir, key, patch_file_name, cache_max_size)
+    return True
 
-# This API applies the patch file over the base_binary file and generates the binary.new file. Then it compares 
-# the hash of new_binary and binary.new, if they are the same then the verification is successful, otherwise it fails.
-def verify_patch(base_binary: str, patch_to_verify: str, new_binary: str) -> None:
+# This API applies the patch file over the base_binary file in memory, hashing the generated binary while it is
+# produced. If its hash matches the hash of new_binary the verification is successful, otherwise it fails.
+def verify_patch(base_binary: str, patch_to_verify: str, new_binary: str) -> bool:
 
-    with open(patch_to_verify, "rb") as original_file:
+    with open(base_binary, "rb") as b_binary, open(patch_to_verify, "rb") as original_file:
+        base_data = b_binary.read()
         original_file.seek(HEADER_SIZE)
         patch_content = original_file.read()
 
-    temp_file_name = None
-    try:
-        with tempfile.NamedTemporaryFile(delete=False) as temp_file:
-            temp_file.write(patch_content)
-            temp_file.flush()
-            temp_file_name = temp_file.name
+    if verify_patch_data(base_data, patch_content, calculate_sha256(new_binary)):
+        print("Patch file verified successfully")
+        return True
+    print("Failed to verify the patch")
+    return False
+
+# Base image seen through read_cb(): counts the reads, as the device issues them, and the seeks between them.
+# For every output sector it also records the set of base sectors read while producing it.
+class SimulatedSource:
+    def __init__(self, data: bytes, buffer_size: int, target) -> None:
+        self.data = data
+        self.buffer_size = buffer_size
+        self.target = target
+        self.pos = 0
+        self.read_sizes = []
+        self.backward_seeks = 0
+        self.forward_seeks = 0
+        self.max_backward_seek = 0
+        self.sectors = set()
+        self.sectors_per_output_sector = {}
 
-        detools.apply_patch_filenames(base_binary, temp_file_name, "binary.new")
+    def read(self, size: int) -> bytes:
+        for offset in range(self.pos, self.pos + size, self.buffer_size):
+            read_size = min(self.buffer_size, self.pos + size - offset)
+            self.read_sizes.append(read_size)
+            output_sector = self.target.size // FLASH_SECTOR_SIZE
+            for sector in range(offset // FLASH_SECTOR_SIZE, (offset + read_size - 1) // FLASH_SECTOR_SIZE + 1):
+                self.sectors.add(sector)
+                self.sectors_per_output_sector.setdefault(output_sector, set()).add(sector)
+        data = self.data[self.pos:self.pos + size]
+        self.pos += size
+        return data
+
+    def seek(self, offset: int, whence: int = os.SEEK_SET) -> int:
+        new_pos = offset if whence == os.SEEK_SET else self.pos + offset
+        if new_pos < self.pos:
+            self.backward_seeks += 1
+            self.max_backward_seek = max(self.max_backward_seek, self.pos - new_pos)
+        elif new_pos > self.pos:
+            self.forward_seeks += 1
+        self.pos = new_pos
+        return self.pos
+
+    def tell(self) -> int:
+        return self.pos
+
+# New image seen through write_cb(): hashes the data and counts the write calls as the device issues them
+class SimulatedTarget(HashWriter):
+    def __init__(self, buffer_size: int) -> None:
+        super().__init__()
+        self.buffer_size = buffer_size
+        self.write_sizes = []
+
+    def write(self, data: bytes) -> int:
+        for offset in range(0, len(data), self.buffer_size):
+            fragment = data[offset:offset + self.buffer_size]
+            self.write_sizes.append(len(fragment))
+            super().write(fragment)
+        return len(data)
+
+# Counts the sizes in power of two buckets, as {upper bound: count}
+def size_histogram(sizes: list) -> dict:
+    histogram = {}
+    for size in sizes:
+        bucket = 1 << max(size - 1, 0).bit_length()
+        histogram[bucket] = histogram.get(bucket, 0) + 1
+    return dict(sorted(histogram.items()))
+
+def print_histogram(title: str, sizes: list) -> None:
+    print(f"{title}:")
+    for bucket, count in size_histogram(sizes).items():
+        print(f"  {bucket // 2 + 1:>5} - {bucket:<5} bytes: {count}")
+
+# Replays the patch like the device does, through an instrumented read_cb()/write_cb() model, and reports the
+# I/O pattern it causes on the base (running) and new (passive) partitions.
+# The working set is the number of distinct base flash sectors read while producing one sector of the new image;
+# its maximum tells how scattered the reads behind a single esp_ota_write() sector are.
+def simulate_patch(base_binary: str, patch_file_name: str, new_binary: str = None,
+                   buffer_size: int = DEVICE_APPLY_BUFFER_SIZE) -> bool:
+    with open(base_binary, "rb") as b_binary, open(patch_file_name, "rb") as p_binary:
+        base_data = b_binary.read()
+        p_binary.seek(HEADER_SIZE)
+        patch_body = p_binary.read()
+
+    if peek_header_type(io.BytesIO(patch_body)) != PATCH_TYPE_SEQUENTIAL:
+        print("Only sequential patches can be simulated")
+        return False
+    target = SimulatedTarget(buffer_size)
+    source = SimulatedSource(base_data, buffer_size, target)
+    try:
+        detools.apply_patch(source, io.BytesIO(patch_body), target)
     except Exception as e:
         print(f"Failed to apply patch: {e}")
-    finally:
-        if temp_file_name and os.path.exists(temp_file_name):
-            os.remove(temp_file_name)
+        return False
 
-    sha_of_new_created_binary = calculate_sha256("binary.new")
-    sha_of_new_binary = calculate_sha256(new_binary)
-    
-    if sha_of_new_created_binary == sha_of_new_binary:
+    working_sets = [len(sectors) for sectors in source.sectors_per_output_sector.values()]
+    print(f"Device buffer size: {buffer_size} bytes")
+    print(f"Source reads: {len(source.read_sizes)} ({sum(source.read_sizes)} bytes, "
+          f"{len(source.sectors)} distinct {FLASH_SECTOR_SIZE} bytes sectors)")
+    print_histogram("Source read sizes", source.read_sizes)
+    print(f"Backward seeks: {source.backward_seeks} (longest {source.max_backward_seek} bytes)")
+    print(f"Forward seeks: {source.forward_seeks}")
+    print(f"Max working set: {max(working_sets, default=0)} base sectors per new image sector "
+          f"(average {sum(working_sets) / max(len(working_sets), 1):.2f})")
+    print(f"Writes: {len(target.write_sizes)} ({target.size} bytes, "
+          f"{(target.size + FLASH_SECTOR_SIZE - 1) // FLASH_SECTOR_SIZE} sectors erased)")
+    print_histogram("Write fragment sizes", target.write_sizes)
+
+    if new_binary:
+        if target.sha256_hash.hexdigest() != calculate_sha256(new_binary):
+            print("Failed to verify the patch")
+            return False
         print("Patch file verified successfully")
-    else:
-        print("Failed to verify the patch")
-    os.remove("binary.new")
+    return True
+
+def _create_matrix_job(job: tuple) -> tuple:
+    chip, base_binary, new_binary, patch_file_name, options = job
+    start = time.monotonic()
+    # A failing job must not stop the others, it is reported as a failed row of the summary
+    try:
+        verified = create_patch(chip, base_binary, new_binary, patch_file_name, **options)
+    except Exception as e:
+        print(f"Failed to create the patch from {base_binary}: {e}")
+        verified = False
+    elapsed = time.monotonic() - start
+    # The patch file of a failed job can be left by an earlier run
+    patch_size = os.path.getsize(patch_file_name) if verified else 0
+    return base_binary, patch_file_name, patch_size, elapsed, verified
+
+# This API generates one patch per base binary towards the same new binary. Patches are created and verified
+# in parallel (one process per job) and a summary table of sizes and timings is written to the output directory.
+# The options are passed as is to create_patch()
+def create_matrix(chip: str, base_binaries: list, new_binary: str, output_dir: str, jobs: int, **options) -> bool:
+    os.makedirs(output_dir, exist_ok=True)
+    new_name = os.path.splitext(os.path.basename(new_binary))[0]
+    base_names = [os.path.splitext(os.path.basename(base_binary))[0] for base_binary in base_binaries]
+    job_list = []
+    for base_binary, base_name in zip(base_binaries, base_names):
+        if base_names.count(base_name) > 1:
+            # Base binaries with the same file name in different directories are told apart by their content
+            base_name += "-" + calculate_sha256(base_binary)[:8]
+        patch_file_name = os.path.join(output_dir, f"{base_name}_to_{new_name}.bin")
+        if any(job[3] == patch_file_name for job in job_list):
+            print(f"Base binary {base_binary} is given twice")
+            return False
+        job_list.append((chip, base_binary, new_binary, patch_file_name, options))
+
+    processes = max(1, min(jobs, len(job_list)))
+    start = time.monotonic()
+    with multiprocessing.Pool(processes=processes) as pool:
+        results = pool.map(_create_matrix_job, job_list)
+    total_time = time.monotonic() - start
+
+    new_size = os.path.getsize(new_binary)
+    base_width = max(len("Base binary"), *(len(os.path.basename(r[0])) for r in results))
+    patch_width = max(len("Patch file"), *(len(os.path.basename(r[1])) for r in results))
+    lines = [f"Target: {new_binary} ({new_size} bytes)",
+             f"{'Base binary':<{base_width}}  {'Patch file':<{patch_width}}  {'Patch size':>10}  {'Ratio':>7}  {'Time (s)':>8}  Verified"]
+    for base_binary, patch_file_name, patch_size, elapsed, verified in results:
+        lines.append(f"{os.path.basename(base_binary):<{base_width}}  {os.path.basename(patch_file_name):<{patch_width}}  {patch_size:>10}  "
+                     f"{100.0 * patch_size / new_size:>6.2f}%  {elapsed:>8.2f}  {'yes' if verified else 'NO'}")
+    lines.append(f"Generated {len(results)} patches in {total_time:.2f} s using {processes} processes")
+    summary = "\n".join(lines)
+
+    with open(os.path.join(output_dir, "summary.txt"), "w") as summary_file:
+        summary_file.write(summary + "\n")
+    print(summary)
+    return all(result[4] for result in results)
 
 def main() -> None:
     if len(sys.argv) < 2:
-        print("Usage: python esp_delta_ota_patch_gen.py create_patch/verify_patch [arguments]")
+        print("Usage: python esp_delta_ota_patch_gen.py create_patch/create_matrix/verify_patch/simulate_patch [arguments]")
         sys.exit(1)
 
     command = sys.argv[1]
@@ -123,16 +825,67 @@ def main() -> None:
         parser.add_argument('--base_binary', help="Path of Base Binary for creating the patch", required=True)
         parser.add_argument('--new_binary', help="Path of New Binary for which patch has to be created", required=True)
         parser.add_argument('--patch_file_name', help="Patch file path", default="patch.bin")
+        parser.add_argument('--cache_dir', help="Directory where base binary indexes and patches are cached between runs")
+        parser.add_argument('--cache_max_size', help="Maximum size of the cache directory in MB", type=int, default=DEFAULT_CACHE_MAX_SIZE)
+        parser.add_argument('--diff_mode', help="Diff the images as raw binaries, segment by segment, or keep the smallest of both",
+                            choices=DIFF_MODES, default='raw')
+        parser.add_argument('--optimize', help="Try every diff algorithm and compression and keep the best one for this goal",
+                            choices=OPTIMIZE_GOALS)
+        parser.add_argument('--patch_type', help="Sequential patch (two app slots) or in-place patch (single app slot)",
+                            choices=PATCH_TYPE_NAMES, default='sequential')
+        parser.add_argument('--memory_size', help="In-place patches: size of the app partition", type=lambda x: int(x, 0))
+        parser.add_argument('--segment_size', help="In-place patches: size of the segments the patch is applied by",
+                            type=lambda x: int(x, 0), default=DEFAULT_SEGMENT_SIZE)
+        parser.add_argument('--report_churn', help="Estimate how many bytes of the patch come from non-code churn",
+                            action='store_true')
+        args = parser.parse_args(sys.argv[2:])
+        if not create_patch(args.chip, args.base_binary, args.new_binary, args.patch_file_name, args.cache_dir, args.cache_max_size,
+                            args.diff_mode, args.optimize, args.patch_type, args.memory_size, args.segment_size,
+                            args.report_churn):
+            sys.exit(1)
+    elif command == 'create_matrix':
+        parser.add_argument('--chip', help="Target", default="esp32")
+        parser.add_argument('--base_binaries', help="Paths of the Base Binaries (e.g. the last N releases)", nargs='+', required=True)
+        parser.add_argument('--new_binary', help="Path of New Binary for which the patches have to be created", required=True)
+        parser.add_argument('--output_dir', help="Directory where the patches and the summary are written", default="patches")
+        parser.add_argument('--jobs', help="Number of parallel jobs", type=int, default=os.cpu_count())
+        parser.add_argument('--cache_dir', help="Directory where base binary indexes and patches are cached between runs")
+        parser.add_argument('--cache_max_size', help="Maximum size of the cache directory in MB", type=int, default=DEFAULT_CACHE_MAX_SIZE)
+        parser.add_argument('--diff_mode', help="Diff the images as raw binaries, segment by segment, or keep the smallest of both",
+                            choices=DIFF_MODES, default='raw')
+        parser.add_argument('--optimize', help="Try every diff algorithm and compression and keep the best one for this goal",
+                            choices=OPTIMIZE_GOALS)
+        parser.add_argument('--patch_type', help="Sequential patch (two app slots) or in-place patch (single app slot)",
+                            choices=PATCH_TYPE_NAMES, default='sequential')
+        parser.add_argument('--memory_size', help="In-place patches: size of the app partition", type=lambda x: int(x, 0))
+        parser.add_argument('--segment_size', help="In-place patches: size of the segments the patch is applied by",
+                            type=lambda x: int(x, 0), default=DEFAULT_SEGMENT_SIZE)
+        parser.add_argument('--report_churn', help="Estimate how many bytes of the patch come from non-code churn",
+                            action='store_true')
         args = parser.parse_args(sys.argv[2:])
-        create_patch(args.chip, args.base_binary, args.new_binary, args.patch_file_name)
+        if not create_matrix(args.chip, args.base_binaries, args.new_binary, args.output_dir, args.jobs, cache_dir=args.cache_dir,
+                             cache_max_size=args.cache_max_size, diff_mode=args.diff_mode, optimize=args.optimize,
+                             patch_type=args.patch_type, memory_size=args.memory_size, segment_size=args.segment_size,
+                             report_churn=args.report_churn):
+            sys.exit(1)
     elif command == 'verify_patch':
         parser.add_argument('--base_binary', help="Path of Base Binary for verifying the patch", required=True)
         parser.add_argument('--patch_file_name', help="Patch file path", required=True)
         parser.add_argument('--new_binary', help="Path of New Binary for verifying the patch", required=True)
         args = parser.parse_args(sys.argv[2:])
-        verify_patch(args.base_binary, args.patch_file_name, args.new_binary)
+        if not verify_patch(args.base_binary, args.patch_file_name, args.new_binary):
+            sys.exit(1)
+    elif command == 'simulate_patch':
+        parser.add_argument('--base_binary', help="Path of Base Binary the patch applies to", required=True)
+        parser.add_argument('--patch_file_name', help="Patch file path", required=True)
+        parser.add_argument('--new_binary', help="Path of New Binary, to also verify the patch")
+        parser.add_argument('--buffer_size', help="Size of the read_cb/write_cb calls on the device", type=int,
+                            default=DEVICE_APPLY_BUFFER_SIZE)
+        args = parser.parse_args(sys.argv[2:])
+        if not simulate_patch(args.base_binary, args.patch_file_name, args.new_binary, args.buffer_size):
+            sys.exit(1)
     else:
-        print("Invalid command. Use 'create_patch' or 'verify_patch'.")
+        print("Invalid command. Use 'create_patch', 'create_matrix', 'verify_patch' or 'simulate_patch'.")
         sys.exit(1)
 
 if __name__ == '__main__':
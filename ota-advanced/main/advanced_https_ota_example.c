@@ -7,6 +7,7 @@
    CONDITIONS OF ANY KIND, either express or implied.
 */
 
+#include <stdio.h>
 #include <string.h>
 #include <inttypes.h>
 
@@ -17,6 +18,7 @@
 #include "esp_system.h"
 #include "esp_event.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "esp_ota_ops.h"
 #include "esp_http_client.h"
 #include "esp_https_ota.h"
@@ -30,6 +32,26 @@
 #include "esp_crt_bundle.h"
 #endif
 
+#ifdef CONFIG_BOOTLOADER_APP_ANTI_ROLLBACK
+#include "esp_efuse.h"
+#endif
+
+#ifdef CONFIG_EXAMPLE_ENABLE_PARALLEL_HTTP_DOWNLOAD
+#include "parallel_ota.h"
+#endif
+
+#ifdef CONFIG_EXAMPLE_OTA_METRICS
+#include "ota_metrics.h"
+#endif
+
+#ifdef CONFIG_EXAMPLE_CONDITIONAL_UPDATE_CHECK
+#include "update_manifest.h"
+#endif
+
+#ifdef CONFIG_EXAMPLE_COMPRESSED_IMAGE
+#include "compressed_ota.h"
+#endif
+
 #if CONFIG_EXAMPLE_CONNECT_WIFI
 #include "esp_wifi.h"
 #endif
@@ -40,6 +62,17 @@
 #define DEBOUNCE_DELAY_MS 200  // Debounce time to avoid bouncing on the button
 
 static const char *TAG = "advanced_https_ota_example";
+
+/* A single OTA task runs at a time. An update requested while one runs is queued, further requests are merged into
+ * the queued one, so that overlapping downloads never race on the partition or double the bandwidth and heap used. */
+typedef enum {
+    OTA_STATE_IDLE,
+    OTA_STATE_RUNNING,
+    OTA_STATE_QUEUED,   // Running, another update follows it
+} ota_state_t;
+
+static portMUX_TYPE s_ota_lock = portMUX_INITIALIZER_UNLOCKED;
+static ota_state_t s_ota_state = OTA_STATE_IDLE;
 extern const uint8_t server_cert_pem_start[] asm("_binary_ca_cert_pem_start");
 extern const uint8_t server_cert_pem_end[] asm("_binary_ca_cert_pem_end");
 
@@ -122,6 +155,169 @@ static void event_handler(void* arg, esp_event_base_t event_base,
                 break;
         }
     }
+#ifdef CONFIG_EXAMPLE_ENABLE_PARALLEL_HTTP_DOWNLOAD
+    else if (event_base == PARALLEL_OTA_EVENT && event_id == PARALLEL_OTA_EVENT_RANGE_SIZE) {
+        parallel_ota_range_size_t *range_size = (parallel_ota_range_size_t *)event_data;
+        ESP_LOGI(TAG, "Range size set to %" PRIu32 " bytes, reason %d", range_size->range_size, range_size->reason);
+    }
+#endif
+#ifdef CONFIG_EXAMPLE_OTA_METRICS
+    else if (event_base == OTA_METRICS_EVENT && event_id == OTA_METRICS_EVENT_PROGRESS) {
+        ota_metrics_t *metrics = (ota_metrics_t *)event_data;
+        if (metrics->eta_ms != UINT32_MAX) {
+            ESP_LOGI(TAG, "Written %" PRIu32 "/%" PRIu32 " bytes, %" PRIu32 " KB/s, %" PRIu32 " s left",
+                     metrics->written, metrics->image_size, metrics->smoothed_throughput / 1024,
+                     metrics->eta_ms / 1000);
+        } else {
+            ESP_LOGI(TAG, "Written %" PRIu32 " bytes, %" PRIu32 " KB/s", metrics->written,
+                     metrics->smoothed_throughput / 1024);
+        }
+    }
+#endif
+}
+
+#if defined(CONFIG_EXAMPLE_VERSION_POLICY_NEWER) || defined(CONFIG_EXAMPLE_VERSION_POLICY_NEWER_MINOR)
+typedef struct {
+    char text[sizeof(((esp_app_desc_t *)0)->version) + 1];
+    int major;
+    int minor;
+    int patch;
+    const char *prerelease;     // Pre-release part after the '-', NULL for a release
+} app_version_t;
+
+// Parses a "[v]MAJOR.MINOR.PATCH[-PRERELEASE][+BUILD]" version, the build metadata is ignored
+static bool parse_version(const char *str, app_version_t *version)
+{
+    // The version field of the descriptor is not terminated when it is full
+    strncpy(version->text, str, sizeof(version->text) - 1);
+    version->text[sizeof(version->text) - 1] = '\0';
+    char *start = version->text[0] == 'v' || version->text[0] == 'V' ? version->text + 1 : version->text;
+    int len = 0;
+    if (sscanf(start, "%d.%d.%d%n", &version->major, &version->minor, &version->patch, &len) != 3) {
+        return false;
+    }
+    char *rest = start + len;
+    if (*rest != '\0' && *rest != '-' && *rest != '+') {
+        return false;
+    }
+    start[strcspn(start, "+")] = '\0';
+    version->prerelease = *rest == '-' ? rest + 1 : NULL;
+    return true;
+}
+
+/* Orders two pre-release parts as semantic versioning does, one dot-separated identifier at a time: numeric identifiers
+ * by their value and before the alphanumeric ones, those in ASCII order, and a prefix before the longer list */
+static int compare_prereleases(const char *a, const char *b)
+{
+    while (*a != '\0' && *b != '\0') {
+        size_t a_len = strcspn(a, ".");
+        size_t b_len = strcspn(b, ".");
+        bool a_numeric = strspn(a, "0123456789") == a_len;
+        bool b_numeric = strspn(b, "0123456789") == b_len;
+        int cmp;
+        if (a_numeric != b_numeric) {
+            cmp = a_numeric ? -1 : 1;
+        } else if (a_numeric && a_len != b_len) {
+            // Numeric identifiers have no leading zeros, the longer one is the larger
+            cmp = a_len < b_len ? -1 : 1;
+        } else {
+            cmp = strncmp(a, b, a_len < b_len ? a_len : b_len);
+            if (cmp == 0 && a_len != b_len) {
+                cmp = a_len < b_len ? -1 : 1;
+            }
+        }
+        if (cmp != 0) {
+            return cmp;
+        }
+        a += a_len + (a[a_len] == '.');
+        b += b_len + (b[b_len] == '.');
+    }
+    return (*a != '\0') - (*b != '\0');
+}
+
+// Orders the versions as semantic versioning does, a pre-release coming before its release
+static int compare_versions(const app_version_t *a, const app_version_t *b)
+{
+    if (a->major != b->major) {
+        return a->major < b->major ? -1 : 1;
+    }
+    if (a->minor != b->minor) {
+        return a->minor < b->minor ? -1 : 1;
+    }
+    if (a->patch != b->patch) {
+        return a->patch < b->patch ? -1 : 1;
+    }
+    if (a->prerelease == NULL || b->prerelease == NULL) {
+        return (a->prerelease == NULL) - (b->prerelease == NULL);
+    }
+    return compare_prereleases(a->prerelease, b->prerelease);
+}
+#endif
+
+/* Decides from the descriptor alone, read from the first few hundred bytes of the image, whether it may be installed.
+ * running is NULL when the descriptor of the running app could not be read. */
+static esp_err_t check_update_policy(const esp_app_desc_t *new_app_info, const esp_app_desc_t *running)
+{
+    // Checked first, so that an image the bootloader would refuse reports the eFuse version
+#ifdef CONFIG_BOOTLOADER_APP_ANTI_ROLLBACK
+    const uint32_t hw_sec_version = esp_efuse_read_secure_version();
+    if (new_app_info->secure_version < hw_sec_version) {
+        ESP_LOGW(TAG, "New firmware security version is less than eFuse programmed, %" PRIu32 " < %" PRIu32,
+                 new_app_info->secure_version, hw_sec_version);
+        return ESP_FAIL;
+    }
+#endif
+    if (new_app_info->secure_version < CONFIG_EXAMPLE_MIN_SECURE_VERSION) {
+        ESP_LOGW(TAG, "New firmware security version %" PRIu32 " is below the minimum %d",
+                 new_app_info->secure_version, CONFIG_EXAMPLE_MIN_SECURE_VERSION);
+        return ESP_FAIL;
+    }
+    if (running != NULL && new_app_info->secure_version < running->secure_version) {
+        ESP_LOGW(TAG, "New firmware security version is less than the running one, %" PRIu32 " < %" PRIu32,
+                 new_app_info->secure_version, running->secure_version);
+        return ESP_FAIL;
+    }
+
+#ifndef CONFIG_EXAMPLE_SKIP_VERSION_CHECK
+    if (running == NULL) {
+        ESP_LOGW(TAG, "Running firmware version unknown, the new version is not compared");
+        return ESP_OK;
+    }
+#ifdef CONFIG_EXAMPLE_VERSION_POLICY_DIFFERENT
+    // Check if the current version is the same as the new version
+    if (memcmp(new_app_info->version, running->version, sizeof(new_app_info->version)) == 0) {
+        ESP_LOGW(TAG, "Current running version is the same as the new one. We will not continue the update.");
+        return ESP_FAIL;
+    }
+#endif
+#if defined(CONFIG_EXAMPLE_VERSION_POLICY_NEWER) || defined(CONFIG_EXAMPLE_VERSION_POLICY_NEWER_MINOR)
+    app_version_t new_version;
+    app_version_t running_version;
+    if (!parse_version(new_app_info->version, &new_version)) {
+        ESP_LOGW(TAG, "New firmware version %s is not a semantic version", new_version.text);
+        return ESP_FAIL;
+    }
+    if (!parse_version(running->version, &running_version)) {
+        ESP_LOGW(TAG, "Running firmware version %s is not a semantic version, the new version is not compared",
+                 running_version.text);
+        return ESP_OK;
+    }
+    if (compare_versions(&new_version, &running_version) <= 0) {
+        ESP_LOGW(TAG, "New firmware version %s is not newer than the running %s", new_version.text,
+                 running_version.text);
+        return ESP_FAIL;
+    }
+#ifdef CONFIG_EXAMPLE_VERSION_POLICY_NEWER_MINOR
+    if (new_version.major == running_version.major && new_version.minor == running_version.minor) {
+        ESP_LOGW(TAG, "New firmware version %s only changes the patch version of the running %s", new_version.text,
+                 running_version.text);
+        return ESP_FAIL;
+    }
+#endif
+#endif
+#endif
+
+    return ESP_OK;
 }
 
 // Function to validate the image header of the new firmware
@@ -133,23 +329,23 @@ static esp_err_t validate_image_header(esp_app_desc_t *new_app_info)
 
     const esp_partition_t *running = esp_ota_get_running_partition();
     esp_app_desc_t running_app_info;
-    if (esp_ota_get_partition_description(running, &running_app_info) == ESP_OK) {
+    bool running_valid = esp_ota_get_partition_description(running, &running_app_info) == ESP_OK;
+    if (running_valid) {
         ESP_LOGI(TAG, "Running firmware version: %s", running_app_info.version);
     }
 
-#ifndef CONFIG_EXAMPLE_SKIP_VERSION_CHECK
-    // Check if the current version is the same as the new version
-    if (memcmp(new_app_info->version, running_app_info.version, sizeof(new_app_info->version)) == 0) {
-        ESP_LOGW(TAG, "Current running version is the same as the new one. We will not continue the update.");
-        return ESP_FAIL;
+    esp_err_t err = check_update_policy(new_app_info, running_valid ? &running_app_info : NULL);
+#ifdef CONFIG_EXAMPLE_CONDITIONAL_UPDATE_CHECK
+    if (err != ESP_OK) {
+        // The manifest points to an image the policy refuses, the next checks can stop at 304 Not Modified
+        update_manifest_commit();
     }
 #endif
-
-    return ESP_OK;
+    return err;
 }
 
-// OTA task to perform HTTPS OTA update
-void advanced_ota_example_task(void *pvParameter)
+// Performs the HTTPS OTA update, returns only when it failed or there was nothing to update
+static esp_err_t advanced_ota_example_run(void)
 {
     ESP_LOGI(TAG, "Starting Advanced OTA example");
 
@@ -163,26 +359,89 @@ void advanced_ota_example_task(void *pvParameter)
 #endif
         .timeout_ms = CONFIG_EXAMPLE_OTA_RECV_TIMEOUT,
         .keep_alive_enable = true,
+#ifdef CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+        // Reconnections of the client, such as further partial download requests, resume the TLS session
+        .save_client_session = true,
+#endif
+#ifdef CONFIG_EXAMPLE_OTA_METRICS
+        .event_handler = ota_metrics_http_event_handler,
+#endif
     };
 
+#ifdef CONFIG_EXAMPLE_CONDITIONAL_UPDATE_CHECK
+    // A 304 response to the manifest request is all it takes to know there is nothing to update
+    bool changed = true;
+    if (update_manifest_check(&config, &changed) == ESP_OK && !changed) {
+        ESP_LOGI(TAG, "Update manifest not modified, no update");
+        return ESP_OK;
+    }
+#endif
+
+#ifdef CONFIG_EXAMPLE_ENABLE_PARALLEL_HTTP_DOWNLOAD
+    // The image is fetched in ranges over several connections instead of the esp_https_ota stream below
+    esp_err_t parallel_err = parallel_ota_download(&config, validate_image_header);
+    if (parallel_err == ESP_OK) {
+        ESP_LOGI(TAG, "Parallel OTA upgrade successful. Rebooting ...");
+#ifdef CONFIG_EXAMPLE_CONDITIONAL_UPDATE_CHECK
+        update_manifest_commit();
+#endif
+        vTaskDelay(1000 / portTICK_PERIOD_MS);  // Delay for stability before rebooting
+        esp_restart();  // Restart the ESP32 to apply the new firmware
+    }
+    ESP_LOGE(TAG, "Parallel OTA upgrade failed");
+    return parallel_err;
+#endif
+
+#ifdef CONFIG_EXAMPLE_COMPRESSED_IMAGE
+    // The image is decompressed as it is received, in the callback esp_https_ota has for decryption
+    compressed_ota_handle_t compressed_ota = NULL;
+    esp_err_t err = compressed_ota_init(validate_image_header, &compressed_ota);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to allocate the decompressor");
+        return err;
+    }
+#else
+    esp_err_t err = ESP_OK;
+#endif
+
     // OTA configuration
     esp_https_ota_config_t ota_config = {
+#ifdef CONFIG_EXAMPLE_LAZY_FLASH_ERASE
+        // Each sector is erased by the first write to it, so only the sectors the image covers are erased
+        .bulk_flash_erase = false,
+#else
         .bulk_flash_erase = true,
+#endif
         .http_config = &config,
 #ifdef CONFIG_EXAMPLE_ENABLE_PARTIAL_HTTP_DOWNLOAD
         .partial_http_download = true,
         .max_http_request_size = CONFIG_EXAMPLE_HTTP_REQUEST_SIZE,
+#endif
+#ifdef CONFIG_EXAMPLE_COMPRESSED_IMAGE
+        .decrypt_cb = compressed_ota_decrypt_cb,
+        .decrypt_user_ctx = compressed_ota,
 #endif
     };
 
     // Start the OTA process
+#ifdef CONFIG_EXAMPLE_OTA_METRICS
+    ota_metrics_start();
+#endif
     esp_https_ota_handle_t https_ota_handle = NULL;
-    esp_err_t err = esp_https_ota_begin(&ota_config, &https_ota_handle);
+    err = esp_https_ota_begin(&ota_config, &https_ota_handle);
     if (err != ESP_OK) {
         ESP_LOGE(TAG, "ESP HTTPS OTA Begin failed");
-        vTaskDelete(NULL);
+#ifdef CONFIG_EXAMPLE_COMPRESSED_IMAGE
+        compressed_ota_deinit(compressed_ota);
+#endif
+        return err;
     }
 
+#ifdef CONFIG_EXAMPLE_COMPRESSED_IMAGE
+    /* esp_https_ota_get_img_desc() is not supported with a decrypt callback. The descriptor is validated by the
+     * decompressor instead, as soon as the first call to esp_https_ota_perform() decompressed it. The image size of
+     * the response is the compressed size, it is not set for the metrics. */
+#else
     // Get and validate the image description of the new firmware
     esp_app_desc_t app_desc;
     err = esp_https_ota_get_img_desc(https_ota_handle, &app_desc);
@@ -190,15 +449,36 @@ void advanced_ota_example_task(void *pvParameter)
         ESP_LOGE(TAG, "esp_https_ota_read_img_desc failed");
         goto ota_end;
     }
+#ifdef CONFIG_EXAMPLE_OTA_METRICS
+    ota_metrics_set_image_size(esp_https_ota_get_image_size(https_ota_handle));
+#endif
     err = validate_image_header(&app_desc);
     if (err != ESP_OK) {
         ESP_LOGE(TAG, "Image header verification failed");
         goto ota_end;
     }
+#ifdef CONFIG_EXAMPLE_LAZY_FLASH_ERASE
+    ESP_LOGI(TAG, "Image accepted, the OTA partition is erased sector by sector as the image is written");
+#endif
+#endif
 
-    // Perform the OTA process (download and write to flash)
+    // Perform the OTA process (download and write to flash). The first call erases the partition in bulk erase
+    // mode, so the time to the first write shows the stall each erase mode puts before the download.
+    int64_t start_time = esp_timer_get_time();
+    bool first_write = true;
     while (1) {
         err = esp_https_ota_perform(https_ota_handle);
+        if (first_write) {
+#ifdef CONFIG_EXAMPLE_COMPRESSED_IMAGE
+            // The descriptor is only checked during this first call, the time includes its download and check
+            ESP_LOGI(TAG, "First data written %" PRId64 " ms after the download started",
+                     (esp_timer_get_time() - start_time) / 1000);
+#else
+            ESP_LOGI(TAG, "First data written %" PRId64 " ms after the image was accepted",
+                     (esp_timer_get_time() - start_time) / 1000);
+#endif
+            first_write = false;
+        }
         if (err != ESP_ERR_HTTPS_OTA_IN_PROGRESS) {
             break;
         }
@@ -206,12 +486,24 @@ void advanced_ota_example_task(void *pvParameter)
     }
 
     // Check if the entire OTA data was received
-    if (esp_https_ota_is_complete_data_received(https_ota_handle) != true) {
+    bool complete = esp_https_ota_is_complete_data_received(https_ota_handle);
+#ifdef CONFIG_EXAMPLE_COMPRESSED_IMAGE
+    // The whole response can hold a truncated stream
+    complete = complete && compressed_ota_is_complete(compressed_ota);
+    compressed_ota_deinit(compressed_ota);
+#endif
+    if (complete != true) {
         ESP_LOGE(TAG, "Complete data was not received.");
+        goto ota_end;
     } else {
+        ESP_LOGI(TAG, "Image of %d bytes written in %" PRId64 " ms", esp_https_ota_get_image_len_read(https_ota_handle),
+                 (esp_timer_get_time() - start_time) / 1000);
         ota_finish_err = esp_https_ota_finish(https_ota_handle);
         if ((err == ESP_OK) && (ota_finish_err == ESP_OK)) {
             ESP_LOGI(TAG, "ESP_HTTPS_OTA upgrade successful. Rebooting ...");
+#ifdef CONFIG_EXAMPLE_CONDITIONAL_UPDATE_CHECK
+            update_manifest_commit();
+#endif
             vTaskDelay(1000 / portTICK_PERIOD_MS);  // Delay for stability before rebooting
             esp_restart();  // Restart the ESP32 to apply the new firmware
         } else {
@@ -219,28 +511,74 @@ void advanced_ota_example_task(void *pvParameter)
                 ESP_LOGE(TAG, "Image validation failed, image is corrupted");
             }
             ESP_LOGE(TAG, "ESP_HTTPS_OTA upgrade failed 0x%x", ota_finish_err);
-            vTaskDelete(NULL);
+            return ota_finish_err != ESP_OK ? ota_finish_err : err;
         }
     }
 
 ota_end:
     esp_https_ota_abort(https_ota_handle);
     ESP_LOGE(TAG, "ESP_HTTPS_OTA upgrade failed");
+    return err != ESP_OK ? err : ESP_FAIL;
+}
+
+// Runs the requested update, then the one queued while it ran, if any
+static void ota_manager_task(void *pvParameter)
+{
+    while (1) {
+        advanced_ota_example_run();
+
+        portENTER_CRITICAL(&s_ota_lock);
+        bool queued = s_ota_state == OTA_STATE_QUEUED;
+        s_ota_state = queued ? OTA_STATE_RUNNING : OTA_STATE_IDLE;
+        portEXIT_CRITICAL(&s_ota_lock);
+        if (!queued) {
+            break;
+        }
+        ESP_LOGI(TAG, "Starting the OTA requested during the previous one");
+    }
     vTaskDelete(NULL);
 }
 
-// Task to blink the LED and print a message every 1 second
+// Requests an update, returns the state before the request
+static ota_state_t ota_manager_request(void)
+{
+    portENTER_CRITICAL(&s_ota_lock);
+    ota_state_t state = s_ota_state;
+    s_ota_state = state == OTA_STATE_IDLE ? OTA_STATE_RUNNING : OTA_STATE_QUEUED;
+    portEXIT_CRITICAL(&s_ota_lock);
+
+    if (state == OTA_STATE_IDLE &&
+            xTaskCreate(&ota_manager_task, "advanced_ota_example_task", 8192, NULL, 5, NULL) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create the OTA task");
+        portENTER_CRITICAL(&s_ota_lock);
+        s_ota_state = OTA_STATE_IDLE;
+        portEXIT_CRITICAL(&s_ota_lock);
+    }
+    return state;
+}
+
+static ota_state_t ota_manager_get_state(void)
+{
+    portENTER_CRITICAL(&s_ota_lock);
+    ota_state_t state = s_ota_state;
+    portEXIT_CRITICAL(&s_ota_lock);
+    return state;
+}
+
+// Task to blink the LED and print a message every 1 second, the LED blinks faster while an OTA is in progress
 void blink_led_task(void *pvParameter)
 {
     while (1) {
+        int delay_ms = ota_manager_get_state() == OTA_STATE_IDLE ? 1000 : 250;
+
         // Toggle the LED state
         gpio_set_level(GPIO_LED_PIN, 1);  // Turn LED ON
         ESP_LOGI(TAG, "LED [%d] ON and message printed...",GPIO_LED_PIN);
-        vTaskDelay(1000 / portTICK_PERIOD_MS); // Wait for 1 second
+        vTaskDelay(delay_ms / portTICK_PERIOD_MS);
 
         gpio_set_level(GPIO_LED_PIN, 0);  // Turn LED OFF
         ESP_LOGI(TAG, "LED [%d] OFF and message printed...",GPIO_LED_PIN);
-        vTaskDelay(1000 / portTICK_PERIOD_MS); // Wait for 1 second
+        vTaskDelay(delay_ms / portTICK_PERIOD_MS);
     }
 }
 
@@ -286,6 +624,13 @@ void app_main(void)
     ESP_ERROR_CHECK(esp_netif_init());  // Initialize network interface
     ESP_ERROR_CHECK(esp_event_loop_create_default());  // Create the default event loop
     ESP_ERROR_CHECK(esp_event_handler_register(ESP_HTTPS_OTA_EVENT, ESP_EVENT_ANY_ID, &event_handler, NULL));
+#ifdef CONFIG_EXAMPLE_ENABLE_PARALLEL_HTTP_DOWNLOAD
+    ESP_ERROR_CHECK(esp_event_handler_register(PARALLEL_OTA_EVENT, ESP_EVENT_ANY_ID, &event_handler, NULL));
+#endif
+#ifdef CONFIG_EXAMPLE_OTA_METRICS
+    ESP_ERROR_CHECK(ota_metrics_init());
+    ESP_ERROR_CHECK(esp_event_handler_register(OTA_METRICS_EVENT, ESP_EVENT_ANY_ID, &event_handler, NULL));
+#endif
 
     // Connect to Wi-Fi or Ethernet (based on configuration)
     ESP_ERROR_CHECK(example_connect());
@@ -296,9 +641,17 @@ void app_main(void)
     // Main loop to check button press and start OTA
     while (1) {
         if (is_button_pressed()) {
-            ESP_LOGI(TAG, "Button pressed! Starting OTA...");
-            // Create OTA task when button is pressed
-            xTaskCreate(&advanced_ota_example_task, "advanced_ota_example_task", 8192, NULL, 5, NULL);
+            switch (ota_manager_request()) {
+                case OTA_STATE_IDLE:
+                    ESP_LOGI(TAG, "Button pressed! Starting OTA...");
+                    break;
+                case OTA_STATE_RUNNING:
+                    ESP_LOGI(TAG, "Button pressed! OTA in progress, another one will follow it");
+                    break;
+                case OTA_STATE_QUEUED:
+                    ESP_LOGD(TAG, "Button pressed! OTA already queued");
+                    break;
+            }
         }
         vTaskDelay(100 / portTICK_PERIOD_MS);  // Delay between button checks (100 ms)
     }
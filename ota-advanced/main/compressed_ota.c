@@ -0,0 +1,228 @@
+/* Compressed HTTPS OTA
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+#include <string.h>
+#include <stdlib.h>
+#include <inttypes.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_app_format.h"
+#include "rom/miniz.h"
+
+#include "compressed_ota.h"
+
+/* The descriptor of the app follows the image header and the header of the first segment */
+#define APP_DESC_OFFSET (sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t))
+#define IMAGE_START_SIZE (APP_DESC_OFFSET + sizeof(esp_app_desc_t))
+
+#define GZIP_HEADER_SIZE 10
+#define GZIP_FLAG_HCRC 0x02
+#define GZIP_FLAG_EXTRA 0x04
+#define GZIP_FLAG_NAME 0x08
+#define GZIP_FLAG_COMMENT 0x10
+
+struct compressed_ota {
+    tinfl_decompressor inflator;
+    uint8_t dict[TINFL_LZ_DICT_SIZE];   // Holds the last 32 KB of output, which the stream refers back to
+    size_t dict_offset;
+    mz_uint32 flags;                    // Parsing flags of the stream, 0 until its header was read
+    tinfl_status status;
+    uint8_t image_start[IMAGE_START_SIZE];  // Start of the image, until the app descriptor is complete
+    size_t image_start_len;
+    compressed_ota_validate_cb_t validate_cb;
+    size_t total_in;
+    size_t total_out;
+    int64_t inflate_us;                 // Time spent in tinfl_decompress()
+};
+
+static const char *TAG = "compressed_ota";
+
+/* Returns the length of the gzip header at the start of data, or 0 when it is not complete in the first chunk */
+static size_t gzip_header_len(const uint8_t *data, size_t len)
+{
+    if (len < GZIP_HEADER_SIZE || data[2] != 8) {
+        return 0;
+    }
+    uint8_t flags = data[3];
+    size_t pos = GZIP_HEADER_SIZE;
+    if (flags & GZIP_FLAG_EXTRA) {
+        if (pos + 2 > len) {
+            return 0;
+        }
+        pos += 2 + (data[pos] | data[pos + 1] << 8);
+    }
+    for (uint8_t flag = GZIP_FLAG_NAME; flag <= GZIP_FLAG_COMMENT; flag <<= 1) {
+        if (flags & flag) {
+            const uint8_t *end = pos < len ? memchr(data + pos, 0, len - pos) : NULL;
+            if (end == NULL) {
+                return 0;
+            }
+            pos = end - data + 1;
+        }
+    }
+    if (flags & GZIP_FLAG_HCRC) {
+        pos += 2;
+    }
+    return pos <= len ? pos : 0;
+}
+
+// Reads the zlib or gzip header from the first chunk, returns the number of bytes to skip before the deflate data
+static esp_err_t parse_stream_header(struct compressed_ota *ota, const uint8_t *data, size_t len, size_t *skip)
+{
+    if (len >= 2 && data[0] == 0x1f && data[1] == 0x8b) {
+        // The CRC-32 of the gzip trailer is not checked, esp_ota_end() checks the SHA-256 of the image
+        *skip = gzip_header_len(data, len);
+        ota->flags = TINFL_FLAG_HAS_MORE_INPUT;
+        return *skip > 0 ? ESP_OK : ESP_ERR_INVALID_SIZE;
+    }
+    if (len >= 2 && (data[0] & 0x0f) == 8 && ((data[0] << 8) | data[1]) % 31 == 0) {
+        *skip = 0;
+        ota->flags = TINFL_FLAG_HAS_MORE_INPUT | TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_COMPUTE_ADLER32;
+        return ESP_OK;
+    }
+    ESP_LOGE(TAG, "The image is not a zlib or gzip stream");
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+// Collects the start of the image and checks its descriptor once it is complete
+static esp_err_t check_image_start(struct compressed_ota *ota, const uint8_t *data, size_t len)
+{
+    if (ota->image_start_len == IMAGE_START_SIZE) {
+        return ESP_OK;
+    }
+    size_t copy = IMAGE_START_SIZE - ota->image_start_len < len ? IMAGE_START_SIZE - ota->image_start_len : len;
+    memcpy(ota->image_start + ota->image_start_len, data, copy);
+    ota->image_start_len += copy;
+    if (ota->image_start_len < IMAGE_START_SIZE) {
+        return ESP_OK;
+    }
+
+    esp_app_desc_t app_desc;
+    memcpy(&app_desc, ota->image_start + APP_DESC_OFFSET, sizeof(app_desc));
+    if (app_desc.magic_word != ESP_APP_DESC_MAGIC_WORD) {
+        ESP_LOGE(TAG, "App descriptor not found in the decompressed image");
+        return ESP_ERR_OTA_VALIDATE_FAILED;
+    }
+    ESP_LOGI(TAG, "New firmware version: %s", app_desc.version);
+    return ota->validate_cb(&app_desc);
+}
+
+// Appends len bytes to the output of the call, growing it as needed
+static esp_err_t append_output(decrypt_cb_arg_t *args, size_t *capacity, const uint8_t *data, size_t len)
+{
+    if (args->data_out_len + len > *capacity) {
+        size_t new_capacity = *capacity;
+        while (args->data_out_len + len > new_capacity) {
+            new_capacity *= 2;
+        }
+        char *data_out = realloc(args->data_out, new_capacity);
+        if (data_out == NULL) {
+            return ESP_ERR_NO_MEM;
+        }
+        args->data_out = data_out;
+        *capacity = new_capacity;
+    }
+    memcpy(args->data_out + args->data_out_len, data, len);
+    args->data_out_len += len;
+    return ESP_OK;
+}
+
+esp_err_t compressed_ota_decrypt_cb(decrypt_cb_arg_t *args, void *user_ctx)
+{
+    struct compressed_ota *ota = user_ctx;
+    const uint8_t *in = (const uint8_t *)args->data_in;
+    size_t in_len = args->data_in_len;
+    ota->total_in += in_len;
+
+    if (ota->flags == 0) {
+        size_t skip = 0;
+        esp_err_t err = parse_stream_header(ota, in, in_len, &skip);
+        if (err != ESP_OK) {
+            return err;
+        }
+        in += skip;
+        in_len -= skip;
+    }
+
+    // esp_https_ota frees the output after writing it. Deflate rarely expands the data less than 4 times.
+    size_t capacity = in_len * 4 > 1024 ? in_len * 4 : 1024;
+    args->data_out = malloc(capacity);
+    args->data_out_len = 0;
+    if (args->data_out == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    esp_err_t err = ESP_OK;
+    int64_t start_time = esp_timer_get_time();
+    // Anything after the end of the stream is the gzip trailer
+    while (ota->status != TINFL_STATUS_DONE) {
+        size_t consumed = in_len;
+        size_t produced = TINFL_LZ_DICT_SIZE - ota->dict_offset;
+        ota->status = tinfl_decompress(&ota->inflator, in, &consumed, ota->dict, ota->dict + ota->dict_offset,
+                                       &produced, ota->flags);
+        in += consumed;
+        in_len -= consumed;
+        if (ota->status < TINFL_STATUS_DONE) {
+            ESP_LOGE(TAG, "Decompression failed: %d", ota->status);
+            err = ESP_FAIL;
+            break;
+        }
+        err = append_output(args, &capacity, ota->dict + ota->dict_offset, produced);
+        if (err == ESP_OK) {
+            err = check_image_start(ota, ota->dict + ota->dict_offset, produced);
+        }
+        if (err != ESP_OK) {
+            break;
+        }
+        ota->dict_offset = (ota->dict_offset + produced) & (TINFL_LZ_DICT_SIZE - 1);
+        if (ota->status != TINFL_STATUS_HAS_MORE_OUTPUT && in_len == 0) {
+            break;
+        }
+    }
+    ota->inflate_us += esp_timer_get_time() - start_time;
+    ota->total_out += args->data_out_len;
+
+    if (err != ESP_OK) {
+        free(args->data_out);
+        args->data_out = NULL;
+        args->data_out_len = 0;
+    }
+    return err;
+}
+
+esp_err_t compressed_ota_init(compressed_ota_validate_cb_t validate_cb, compressed_ota_handle_t *handle)
+{
+    struct compressed_ota *ota = calloc(1, sizeof(*ota));
+    if (ota == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    tinfl_init(&ota->inflator);
+    ota->status = TINFL_STATUS_NEEDS_MORE_INPUT;
+    ota->validate_cb = validate_cb;
+    *handle = ota;
+    return ESP_OK;
+}
+
+bool compressed_ota_is_complete(compressed_ota_handle_t handle)
+{
+    return handle->status == TINFL_STATUS_DONE;
+}
+
+void compressed_ota_deinit(compressed_ota_handle_t handle)
+{
+    if (handle == NULL) {
+        return;
+    }
+    if (handle->total_out > 0) {
+        ESP_LOGI(TAG, "%zu bytes received for %zu bytes of image (%zu%%), decompressed in %" PRId64 " ms",
+                 handle->total_in, handle->total_out, handle->total_in * 100 / handle->total_out,
+                 handle->inflate_us / 1000);
+    }
+    free(handle);
+}
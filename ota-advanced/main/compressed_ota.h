@@ -0,0 +1,34 @@
+/* Compressed HTTPS OTA
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+#pragma once
+
+#include <stdbool.h>
+
+#include "esp_err.h"
+#include "esp_app_desc.h"
+#include "esp_https_ota.h"
+
+typedef struct compressed_ota *compressed_ota_handle_t;
+
+/* Called with the descriptor of the new image as soon as it is decompressed, the update is cancelled when it does
+ * not return ESP_OK. esp_https_ota_get_img_desc() is not supported with a decrypt callback, this takes its place. */
+typedef esp_err_t (*compressed_ota_validate_cb_t)(esp_app_desc_t *new_app_info);
+
+/* Allocates the decompressor state, about 43 KB with the 32 KB dictionary */
+esp_err_t compressed_ota_init(compressed_ota_validate_cb_t validate_cb, compressed_ota_handle_t *handle);
+
+/* To be set as the decrypt_cb of esp_https_ota_config_t, with the handle as decrypt_user_ctx. Decompresses a zlib or
+ * gzip stream, the compressed data being passed in as it is received. */
+esp_err_t compressed_ota_decrypt_cb(decrypt_cb_arg_t *args, void *user_ctx);
+
+/* Returns true once the end of the compressed stream was decompressed, a truncated stream is not */
+bool compressed_ota_is_complete(compressed_ota_handle_t handle);
+
+/* Logs the compression ratio and the time spent decompressing, and frees the decompressor */
+void compressed_ota_deinit(compressed_ota_handle_t handle);
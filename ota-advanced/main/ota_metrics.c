@@ -0,0 +1,156 @@
+/* HTTPS OTA progress metrics
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+#include <string.h>
+#include <inttypes.h>
+
+#include "freertos/FreeRTOS.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_https_ota.h"
+
+#include "ota_metrics.h"
+
+#define INTERVAL_US (CONFIG_EXAMPLE_OTA_METRICS_INTERVAL_MS * 1000LL)
+
+ESP_EVENT_DEFINE_BASE(OTA_METRICS_EVENT);
+
+/* The HTTP client events are handled in the OTA task, the OTA events in the event loop task */
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+static struct {
+    int64_t start_time;
+    int64_t connected_time;
+    int64_t header_time;
+    int64_t chip_id_time;
+    int64_t first_write_time;
+    int64_t last_write_time;
+    int64_t post_time;          // When the last progress event was posted
+    uint32_t post_written;      // Bytes written then
+    ota_metrics_t metrics;
+} s_state;
+
+static const char *TAG = "ota_metrics";
+
+static uint32_t elapsed_ms(int64_t from, int64_t to)
+{
+    return from != 0 ? (to - from) / 1000 : 0;
+}
+
+// Updates the throughput and the ETA from the bytes written since the previous event. Called with the lock held.
+static void update_throughput(int64_t now)
+{
+    ota_metrics_t *metrics = &s_state.metrics;
+    int64_t interval_us = now - s_state.post_time;
+    if (interval_us > 0) {
+        metrics->throughput = (metrics->written - s_state.post_written) * 1000000LL / interval_us;
+        // Smoothed with a weight of 1/4 for the last interval
+        metrics->smoothed_throughput = metrics->smoothed_throughput ?
+                                       (3 * metrics->smoothed_throughput + metrics->throughput) / 4 :
+                                       metrics->throughput;
+    }
+    if (metrics->image_size > metrics->written && metrics->smoothed_throughput > 0) {
+        metrics->eta_ms = (int64_t)(metrics->image_size - metrics->written) * 1000 / metrics->smoothed_throughput;
+    } else {
+        metrics->eta_ms = metrics->image_size == metrics->written ? 0 : UINT32_MAX;
+    }
+    s_state.post_time = now;
+    s_state.post_written = metrics->written;
+}
+
+static void ota_event_handler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data)
+{
+    int64_t now = esp_timer_get_time();
+    ota_metrics_t metrics;
+    int32_t post_id = -1;
+
+    portENTER_CRITICAL(&s_lock);
+    switch (event_id) {
+        case ESP_HTTPS_OTA_VERIFY_CHIP_ID:
+            s_state.chip_id_time = now;
+            break;
+        case ESP_HTTPS_OTA_WRITE_FLASH:
+            if (s_state.first_write_time == 0) {
+                s_state.first_write_time = s_state.post_time = now;
+                s_state.metrics.stage_ms[OTA_METRICS_STAGE_ERASE] = elapsed_ms(s_state.chip_id_time, now);
+            }
+            s_state.last_write_time = now;
+            s_state.metrics.written = *(int *)event_data;
+            s_state.metrics.stage_ms[OTA_METRICS_STAGE_TRANSFER] = elapsed_ms(s_state.first_write_time, now);
+            if (now - s_state.post_time >= INTERVAL_US) {
+                update_throughput(now);
+                post_id = OTA_METRICS_EVENT_PROGRESS;
+            }
+            break;
+        case ESP_HTTPS_OTA_UPDATE_BOOT_PARTITION:
+            s_state.metrics.stage_ms[OTA_METRICS_STAGE_VALIDATE] = elapsed_ms(s_state.last_write_time, now);
+            break;
+        case ESP_HTTPS_OTA_FINISH:
+        case ESP_HTTPS_OTA_ABORT:
+            // The final event carries the average over the whole transfer
+            s_state.post_time = s_state.first_write_time;
+            s_state.post_written = 0;
+            s_state.metrics.smoothed_throughput = 0;
+            update_throughput(s_state.last_write_time);
+            post_id = OTA_METRICS_EVENT_DONE;
+            break;
+        default:
+            break;
+    }
+    metrics = s_state.metrics;
+    portEXIT_CRITICAL(&s_lock);
+
+    if (post_id == OTA_METRICS_EVENT_DONE) {
+        ESP_LOGI(TAG, "Connect %" PRIu32 " ms, first byte %" PRIu32 " ms, erase %" PRIu32 " ms, transfer %" PRIu32
+                 " ms, validate %" PRIu32 " ms, %" PRIu32 " bytes/s", metrics.stage_ms[OTA_METRICS_STAGE_CONNECT],
+                 metrics.stage_ms[OTA_METRICS_STAGE_FIRST_BYTE], metrics.stage_ms[OTA_METRICS_STAGE_ERASE],
+                 metrics.stage_ms[OTA_METRICS_STAGE_TRANSFER], metrics.stage_ms[OTA_METRICS_STAGE_VALIDATE],
+                 metrics.throughput);
+    }
+    if (post_id >= 0) {
+        esp_event_post(OTA_METRICS_EVENT, post_id, &metrics, sizeof(metrics), 0);
+    }
+}
+
+esp_err_t ota_metrics_init(void)
+{
+    return esp_event_handler_register(ESP_HTTPS_OTA_EVENT, ESP_EVENT_ANY_ID, &ota_event_handler, NULL);
+}
+
+void ota_metrics_start(void)
+{
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&s_lock);
+    memset(&s_state, 0, sizeof(s_state));
+    s_state.start_time = now;
+    s_state.metrics.eta_ms = UINT32_MAX;
+    portEXIT_CRITICAL(&s_lock);
+}
+
+void ota_metrics_set_image_size(uint32_t image_size)
+{
+    portENTER_CRITICAL(&s_lock);
+    s_state.metrics.image_size = image_size;
+    portEXIT_CRITICAL(&s_lock);
+}
+
+esp_err_t ota_metrics_http_event_handler(esp_http_client_event_t *evt)
+{
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&s_lock);
+    // Only the first request is timed, the partial HTTP download connects again for each request
+    if (evt->event_id == HTTP_EVENT_ON_CONNECTED && s_state.connected_time == 0) {
+        s_state.connected_time = now;
+        s_state.metrics.stage_ms[OTA_METRICS_STAGE_CONNECT] = elapsed_ms(s_state.start_time, now);
+    } else if (evt->event_id == HTTP_EVENT_ON_HEADER && s_state.connected_time != 0 && s_state.header_time == 0) {
+        s_state.header_time = now;
+        s_state.metrics.stage_ms[OTA_METRICS_STAGE_FIRST_BYTE] = elapsed_ms(s_state.connected_time, now);
+    }
+    portEXIT_CRITICAL(&s_lock);
+    return ESP_OK;
+}
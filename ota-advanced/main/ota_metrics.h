@@ -0,0 +1,52 @@
+/* HTTPS OTA progress metrics
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+#pragma once
+
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "esp_event.h"
+#include "esp_http_client.h"
+
+ESP_EVENT_DECLARE_BASE(OTA_METRICS_EVENT);
+
+typedef enum {
+    OTA_METRICS_EVENT_PROGRESS,     // Posted at most every CONFIG_EXAMPLE_OTA_METRICS_INTERVAL_MS, data is an ota_metrics_t
+    OTA_METRICS_EVENT_DONE,         // The update finished or was aborted, data is the final ota_metrics_t
+} ota_metrics_event_t;
+
+typedef enum {
+    OTA_METRICS_STAGE_CONNECT,      // DNS lookup, TCP connection and TLS handshake of the first request
+    OTA_METRICS_STAGE_FIRST_BYTE,   // From the connection to the first response header
+    OTA_METRICS_STAGE_ERASE,        // From the chip id check to the first write, the bulk erase when enabled
+    OTA_METRICS_STAGE_TRANSFER,     // From the first write to the last one
+    OTA_METRICS_STAGE_VALIDATE,     // From the last write to the boot partition update
+    OTA_METRICS_STAGE_MAX,
+} ota_metrics_stage_t;
+
+typedef struct {
+    uint32_t written;               // Bytes of the image written to flash
+    uint32_t image_size;            // 0 when not known
+    uint32_t throughput;            // Bytes/s written since the previous event
+    uint32_t smoothed_throughput;   // Bytes/s, smoothed over the previous events
+    uint32_t eta_ms;                // Estimated time to the last write, UINT32_MAX when not known
+    uint32_t stage_ms[OTA_METRICS_STAGE_MAX];   // Time spent in each stage, 0 for the stages not reached yet
+} ota_metrics_t;
+
+/* Registers for the ESP_HTTPS_OTA_EVENT events the metrics are derived from */
+esp_err_t ota_metrics_init(void);
+
+/* Starts the metrics of a new update, to be called right before esp_https_ota_begin() */
+void ota_metrics_start(void);
+
+/* Sets the size of the image, from esp_https_ota_get_image_size(), for the ETA */
+void ota_metrics_set_image_size(uint32_t image_size);
+
+/* To be set as the event_handler of the HTTP client configuration, times the connection and the first response */
+esp_err_t ota_metrics_http_event_handler(esp_http_client_event_t *evt);
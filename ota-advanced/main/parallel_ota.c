@@ -0,0 +1,688 @@
+/* Parallel HTTPS OTA
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <inttypes.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_ota_ops.h"
+#include "esp_partition.h"
+#include "esp_app_format.h"
+#include "esp_image_format.h"
+#include "nvs.h"
+#include "mbedtls/sha256.h"
+
+#include "parallel_ota.h"
+
+#define WORKER_STACK_SIZE 8192
+#define WORKER_PRIORITY 5
+#ifdef CONFIG_EXAMPLE_PARALLEL_ADAPTIVE_RANGE_SIZE
+#define RANGE_SIZE_MIN CONFIG_EXAMPLE_PARALLEL_RANGE_SIZE_MIN
+#define RANGE_SIZE_MAX CONFIG_EXAMPLE_PARALLEL_RANGE_SIZE_MAX
+#define RANGE_TIME_MAX_US (CONFIG_EXAMPLE_PARALLEL_RANGE_TIME_MS * 1000LL)
+#else
+#define RANGE_SIZE_MIN CONFIG_EXAMPLE_PARALLEL_RANGE_SIZE
+#define RANGE_SIZE_MAX CONFIG_EXAMPLE_PARALLEL_RANGE_SIZE
+#define RANGE_TIME_MAX_US INT64_MAX
+#endif
+/* A range grows while its request round trip takes more than 1/RTT_RATIO of its transfer time */
+#define RTT_RATIO 8
+/* The written data is checkpointed each time the written prefix of the image grows by a segment */
+#define SEGMENT_SIZE (CONFIG_EXAMPLE_PARALLEL_CHECKPOINT_SECTORS * SPI_FLASH_SEC_SIZE)
+#define CHECKPOINT_NAMESPACE "ota_resume"
+#define CHECKPOINT_KEY "checkpoint"
+#define HASH_LEN 32
+#define READ_BUFFER_SIZE 4096
+/* The body is read in small chunks, so that the time between two reads follows the arrival of the data */
+#define READ_CHUNK_SIZE 1024
+#define STALL_TIMEOUT_MIN_US (CONFIG_EXAMPLE_PARALLEL_STALL_TIMEOUT_MIN_MS * 1000LL)
+#define STALL_TIMEOUT_MAX_US (CONFIG_EXAMPLE_OTA_RECV_TIMEOUT * 1000LL)
+/* The descriptor of the app follows the image header and the header of the first segment */
+#define APP_DESC_OFFSET (sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t))
+
+// Writes to encrypted flash are done in blocks of 16 bytes, a range must not start in the middle of one
+_Static_assert(CONFIG_EXAMPLE_PARALLEL_RANGE_SIZE % 16 == 0 && RANGE_SIZE_MIN % 16 == 0 && RANGE_SIZE_MAX % 16 == 0,
+               "The range sizes must be multiples of 16");
+_Static_assert(RANGE_SIZE_MIN <= CONFIG_EXAMPLE_PARALLEL_RANGE_SIZE && CONFIG_EXAMPLE_PARALLEL_RANGE_SIZE <= RANGE_SIZE_MAX,
+               "CONFIG_EXAMPLE_PARALLEL_RANGE_SIZE must be within the range size bounds");
+
+ESP_EVENT_DEFINE_BASE(PARALLEL_OTA_EVENT);
+
+/* Identifies the image being downloaded and how much of it is in flash. The hash chain runs over the segments of the
+ * prefix, each link being the SHA-256 of the previous one and the segment read back from flash, so that a resumed
+ * download checks the data it does not download again. */
+typedef struct {
+    uint32_t partition_address;
+    uint32_t image_size;
+    uint8_t elf_sha256[HASH_LEN];   // From the app descriptor of the image
+    uint32_t segment_size;
+    uint32_t offset;                // Length of the checked prefix, a multiple of segment_size
+    uint8_t chain_hash[HASH_LEN];
+} parallel_ota_checkpoint_t;
+
+typedef struct {
+    const esp_partition_t *partition;
+    uint8_t *erased;            // One bit per sector of the partition, set once the sector is erased or checkpointed
+    SemaphoreHandle_t lock;     // Protects the fields below and the writes to the partition
+    SemaphoreHandle_t done;     // Given by each worker when it exits
+    uint32_t image_size;
+    uint32_t next_offset;       // Start of the first range not handed out to a worker yet
+    uint32_t in_flight[CONFIG_EXAMPLE_PARALLEL_CONNECTIONS];   // Start of the range of each worker, UINT32_MAX if none
+    parallel_ota_checkpoint_t checkpoint;
+    uint32_t written;
+    uint32_t range_size;        // Size of the next ranges handed out
+    int64_t rtt_us;             // Smoothed time from a request to its response headers
+    int64_t throughput;         // Smoothed transfer rate of a range in bytes/s, after the headers
+    int connections[2];         // Connections set up without, then with, the TLS session of an earlier connection
+    int64_t connection_us[2];   // Total time taken to set them up
+    int stalls;                 // Connections torn down because no data arrived within the stall timeout
+    int64_t recovery_us;        // Total time from a stall to the first data over the new connection
+    int timeout_ms;             // Timeout of the HTTP client configuration, used to connect
+    esp_err_t err;              // First error of any worker, which stops all of them
+} parallel_ota_t;
+
+typedef struct {
+    parallel_ota_t *ota;
+    esp_http_client_handle_t client;
+    uint8_t *buffer;            // Holds one range of up to RANGE_SIZE_MAX bytes until it is written
+    int id;
+    bool connected;
+    bool resumable;             // The client holds the TLS session of an earlier connection
+    int64_t gap_us;             // Smoothed time between two reads that returned data
+    int64_t gap_var_us;         // Smoothed deviation of that time
+    int64_t stall_time;         // When the last stall was detected, 0 once data arrived again
+} parallel_ota_worker_t;
+
+static const char *TAG = "parallel_ota";
+
+/* The clients are kept from one update attempt to the next. With CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS, each one
+ * keeps the TLS session of its last connection, which its next connection resumes instead of running a full
+ * handshake, whether it is a retry, a range after the server closed the connection or the next attempt. */
+static parallel_ota_worker_t s_workers[CONFIG_EXAMPLE_PARALLEL_CONNECTIONS];
+
+// Reads the image size from the response to a HEAD request, as esp_https_ota does for partial downloads
+static esp_err_t get_image_size(esp_http_client_handle_t client, uint32_t *image_size)
+{
+    esp_http_client_set_method(client, HTTP_METHOD_HEAD);
+    esp_err_t err = esp_http_client_perform(client);
+    esp_http_client_set_method(client, HTTP_METHOD_GET);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "HEAD request failed: %s", esp_err_to_name(err));
+        return err;
+    }
+    int status = esp_http_client_get_status_code(client);
+    int64_t content_length = esp_http_client_get_content_length(client);
+    esp_http_client_close(client);
+    if (status != 200 || content_length <= 0) {
+        ESP_LOGE(TAG, "Unexpected response to HEAD request: status %d, length %" PRId64, status, content_length);
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+    *image_size = content_length;
+    return ESP_OK;
+}
+
+/* The connection is considered stalled when no data arrived for 4 deviations over the smoothed gap between reads, as
+ * TCP derives its retransmission timeout, and never less than twice the request round trip */
+static int64_t stall_timeout(const parallel_ota_worker_t *worker, int64_t rtt_us)
+{
+    int64_t timeout_us = worker->gap_us + 4 * worker->gap_var_us;
+    timeout_us = timeout_us > 2 * rtt_us ? timeout_us : 2 * rtt_us;
+    return timeout_us < STALL_TIMEOUT_MIN_US ? STALL_TIMEOUT_MIN_US :
+           timeout_us > STALL_TIMEOUT_MAX_US ? STALL_TIMEOUT_MAX_US : timeout_us;
+}
+
+static void update_gap(parallel_ota_worker_t *worker, int64_t gap_us)
+{
+    if (worker->gap_us == 0) {
+        worker->gap_us = gap_us;
+        worker->gap_var_us = gap_us / 2;
+        return;
+    }
+    int64_t deviation = gap_us > worker->gap_us ? gap_us - worker->gap_us : worker->gap_us - gap_us;
+    worker->gap_var_us = (3 * worker->gap_var_us + deviation) / 4;
+    worker->gap_us = (7 * worker->gap_us + gap_us) / 8;
+}
+
+/* Fetches the part of the range at offset that is not in the buffer yet, *received being the length of the part that
+ * is. *received keeps the progress when the connection fails or stalls, the next attempt continues from there. */
+static esp_err_t fetch_range(parallel_ota_worker_t *worker, uint32_t offset, uint32_t length, uint32_t *received,
+                             int64_t *open_us, int64_t *rtt_us, int64_t *transfer_us)
+{
+    esp_http_client_handle_t client = worker->client;
+    int64_t open_time = esp_timer_get_time();
+    char range[32];
+    snprintf(range, sizeof(range), "bytes=%" PRIu32 "-%" PRIu32, offset + *received, offset + length - 1);
+    esp_http_client_set_header(client, "Range", range);
+
+    esp_http_client_set_timeout_ms(client, worker->ota->timeout_ms);
+    esp_err_t err = esp_http_client_open(client, 0);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to open HTTP connection: %s", esp_err_to_name(err));
+        return err;
+    }
+    int64_t request_time = esp_timer_get_time();
+    *open_us = request_time - open_time;
+    int64_t content_length = esp_http_client_fetch_headers(client);
+    int64_t headers_time = esp_timer_get_time();
+    *rtt_us = headers_time - request_time;
+    int status = esp_http_client_get_status_code(client);
+    if (status == 200) {
+        ESP_LOGE(TAG, "Server does not support Range requests");
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    if (status != 206 || content_length != length - *received) {
+        ESP_LOGE(TAG, "Unexpected response to %s: status %d, length %" PRId64, range, status, content_length);
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+
+    // The client timeout bounds each read, a stall is detected at most one timeout after the last data
+    int64_t timeout_us = stall_timeout(worker, *rtt_us);
+    esp_http_client_set_timeout_ms(client, timeout_us / 1000);
+    int64_t last_data_time = headers_time;
+    while (*received < length) {
+        uint32_t chunk = length - *received < READ_CHUNK_SIZE ? length - *received : READ_CHUNK_SIZE;
+        int64_t read_time = esp_timer_get_time();
+        int len = esp_http_client_read(client, (char *)worker->buffer + *received, chunk);
+        int64_t now = esp_timer_get_time();
+        if (len > 0) {
+            if (worker->stall_time != 0) {
+                int64_t recovery_us = now - worker->stall_time;
+                ESP_LOGI(TAG, "Connection %d recovered from the stall in %" PRId64 " ms", worker->id,
+                         recovery_us / 1000);
+                xSemaphoreTake(worker->ota->lock, portMAX_DELAY);
+                worker->ota->recovery_us += recovery_us;
+                xSemaphoreGive(worker->ota->lock);
+                worker->stall_time = 0;
+            }
+            update_gap(worker, now - last_data_time);
+            last_data_time = now;
+            *received += len;
+            continue;
+        }
+        // A read that returns nothing well before the timeout means the connection was closed
+        if ((len < 0 && len != -ESP_ERR_HTTP_EAGAIN) || (len == 0 && now - read_time < timeout_us / 2)) {
+            ESP_LOGE(TAG, "Connection closed after %" PRIu32 " bytes of range at 0x%" PRIx32, *received, offset);
+            return ESP_FAIL;
+        }
+        if (now - last_data_time >= timeout_us) {
+            ESP_LOGW(TAG, "Connection %d stalled, no data for %" PRId64 " ms after %" PRIu32 " bytes of range at 0x%"
+                     PRIx32, worker->id, (now - last_data_time) / 1000, *received, offset);
+            worker->stall_time = now;
+            xSemaphoreTake(worker->ota->lock, portMAX_DELAY);
+            worker->ota->stalls++;
+            xSemaphoreGive(worker->ota->lock);
+            return ESP_ERR_TIMEOUT;
+        }
+    }
+    *transfer_us = esp_timer_get_time() - headers_time;
+    return ESP_OK;
+}
+
+/* Picks the size of the next ranges from the outcome of the last one. A range should be large enough that its
+ * request round trip is small compared to its transfer, and small enough that a dropped connection loses at most
+ * CONFIG_EXAMPLE_PARALLEL_RANGE_TIME_MS of transfer. A failed range halves the size. Called with the lock held. */
+static void adapt_range_size(parallel_ota_t *ota, esp_err_t err, uint32_t length, int64_t rtt_us, int64_t transfer_us)
+{
+    parallel_ota_range_size_t event = { .reason = PARALLEL_OTA_RANGE_SHRINK_FAILURE };
+    uint32_t range_size = ota->range_size;
+    if (err != ESP_OK) {
+        range_size /= 2;
+    } else {
+        // Smoothed with a weight of 1/4 for the last range
+        ota->rtt_us = ota->rtt_us ? (3 * ota->rtt_us + rtt_us) / 4 : rtt_us;
+        int64_t throughput = length * 1000000LL / (transfer_us > 0 ? transfer_us : 1);
+        ota->throughput = ota->throughput ? (3 * ota->throughput + throughput) / 4 : throughput;
+
+        int64_t range_time_us = range_size * 1000000LL / ota->throughput;
+        if (range_time_us > RANGE_TIME_MAX_US) {
+            range_size /= 2;
+            event.reason = PARALLEL_OTA_RANGE_SHRINK_SLOW;
+        } else if (ota->rtt_us * RTT_RATIO > range_time_us && range_time_us * 2 <= RANGE_TIME_MAX_US) {
+            range_size *= 2;
+            event.reason = PARALLEL_OTA_RANGE_GROW_RTT;
+        }
+    }
+    range_size &= ~15;
+    range_size = range_size < RANGE_SIZE_MIN ? RANGE_SIZE_MIN : range_size > RANGE_SIZE_MAX ? RANGE_SIZE_MAX : range_size;
+    if (range_size == ota->range_size) {
+        return;
+    }
+
+    event.range_size = range_size;
+    event.rtt_ms = ota->rtt_us / 1000;
+    event.throughput = ota->throughput;
+    ESP_LOGI(TAG, "Range size %" PRIu32 " -> %" PRIu32 " bytes (RTT %" PRIu32 " ms, %" PRIu32 " bytes/s%s)",
+             ota->range_size, range_size, event.rtt_ms, event.throughput, err != ESP_OK ? ", range failed" : "");
+    ota->range_size = range_size;
+    esp_event_post(PARALLEL_OTA_EVENT, PARALLEL_OTA_EVENT_RANGE_SIZE, &event, sizeof(event), 0);
+}
+
+/* A failed or stalled attempt only loses its connection: the next one continues the range from the data received so
+ * far. Only attempts that received nothing count as retries. */
+static esp_err_t fetch_range_with_retry(parallel_ota_worker_t *worker, uint32_t offset, uint32_t length)
+{
+    esp_err_t err = ESP_FAIL;
+    uint32_t received = 0;
+    int retries = 0;
+    while (1) {
+        uint32_t start = received;
+        int64_t open_us = 0;
+        int64_t rtt_us = 0;
+        int64_t transfer_us = 0;
+        err = fetch_range(worker, offset, length, &received, &open_us, &rtt_us, &transfer_us);
+        xSemaphoreTake(worker->ota->lock, portMAX_DELAY);
+        if (!worker->connected && open_us > 0) {
+            // esp_http_client_open() connected, which includes the TLS handshake
+            worker->ota->connections[worker->resumable]++;
+            worker->ota->connection_us[worker->resumable] += open_us;
+            worker->connected = true;
+#ifdef CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+            worker->resumable = true;
+#endif
+        }
+        adapt_range_size(worker->ota, err, length - start, rtt_us, transfer_us);
+        xSemaphoreGive(worker->ota->lock);
+        if (err == ESP_OK || err == ESP_ERR_NOT_SUPPORTED) {
+            break;
+        }
+        if (received == start && ++retries > CONFIG_EXAMPLE_PARALLEL_RANGE_RETRIES) {
+            break;
+        }
+        // The next attempt starts from a new connection
+        esp_http_client_close(worker->client);
+        worker->connected = false;
+        ESP_LOGW(TAG, "Reconnecting for range at 0x%" PRIx32 " from 0x%" PRIx32 " (retry %d/%d)", offset,
+                 offset + received, retries, CONFIG_EXAMPLE_PARALLEL_RANGE_RETRIES);
+    }
+    return err;
+}
+
+static esp_err_t check_image(const uint8_t *data, parallel_ota_validate_cb_t validate_cb, esp_app_desc_t *app_desc)
+{
+    const esp_image_header_t *image_header = (const esp_image_header_t *)data;
+    if (image_header->magic != ESP_IMAGE_HEADER_MAGIC) {
+        ESP_LOGE(TAG, "Invalid magic byte 0x%02x, not an app image", image_header->magic);
+        return ESP_ERR_OTA_VALIDATE_FAILED;
+    }
+    if (image_header->chip_id != CONFIG_IDF_FIRMWARE_CHIP_ID) {
+        ESP_LOGE(TAG, "Mismatch chip id, expected %d, found %d", CONFIG_IDF_FIRMWARE_CHIP_ID, image_header->chip_id);
+        return ESP_ERR_OTA_VALIDATE_FAILED;
+    }
+    memcpy(app_desc, data + APP_DESC_OFFSET, sizeof(*app_desc));
+    if (app_desc->magic_word != ESP_APP_DESC_MAGIC_WORD) {
+        ESP_LOGE(TAG, "App descriptor not found");
+        return ESP_ERR_OTA_VALIDATE_FAILED;
+    }
+    ESP_LOGI(TAG, "New firmware version: %s", app_desc->version);
+    return validate_cb(app_desc);
+}
+
+// Extends the hash chain with the segment of flash at offset
+static esp_err_t chain_segment(const esp_partition_t *partition, uint32_t offset, uint8_t chain_hash[HASH_LEN])
+{
+    uint8_t *buffer = malloc(READ_BUFFER_SIZE);
+    if (buffer == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    mbedtls_sha256_context ctx;
+    mbedtls_sha256_init(&ctx);
+    mbedtls_sha256_starts(&ctx, 0);
+    mbedtls_sha256_update(&ctx, chain_hash, HASH_LEN);
+    esp_err_t err = ESP_OK;
+    for (uint32_t pos = 0; pos < SEGMENT_SIZE && err == ESP_OK; pos += READ_BUFFER_SIZE) {
+        err = esp_partition_read(partition, offset + pos, buffer, READ_BUFFER_SIZE);
+        mbedtls_sha256_update(&ctx, buffer, READ_BUFFER_SIZE);
+    }
+    mbedtls_sha256_finish(&ctx, chain_hash);
+    mbedtls_sha256_free(&ctx);
+    free(buffer);
+    return err;
+}
+
+static esp_err_t save_checkpoint(const parallel_ota_checkpoint_t *checkpoint)
+{
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(CHECKPOINT_NAMESPACE, NVS_READWRITE, &handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = nvs_set_blob(handle, CHECKPOINT_KEY, checkpoint, sizeof(*checkpoint));
+    if (err == ESP_OK) {
+        err = nvs_commit(handle);
+    }
+    nvs_close(handle);
+    return err;
+}
+
+static void clear_checkpoint(void)
+{
+    nvs_handle_t handle;
+    if (nvs_open(CHECKPOINT_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) {
+        return;
+    }
+    if (nvs_erase_key(handle, CHECKPOINT_KEY) == ESP_OK) {
+        nvs_commit(handle);
+    }
+    nvs_close(handle);
+}
+
+/* Returns where the download starts: the end of the prefix recorded by the checkpoint of an interrupted download of
+ * the same image, once its hash chain matches the flash, or 0 */
+static uint32_t load_checkpoint(parallel_ota_t *ota, const esp_app_desc_t *app_desc)
+{
+    parallel_ota_checkpoint_t *checkpoint = &ota->checkpoint;
+    memset(checkpoint, 0, sizeof(*checkpoint));
+    checkpoint->partition_address = ota->partition->address;
+    checkpoint->image_size = ota->image_size;
+    memcpy(checkpoint->elf_sha256, app_desc->app_elf_sha256, HASH_LEN);
+    checkpoint->segment_size = SEGMENT_SIZE;
+
+    parallel_ota_checkpoint_t saved;
+    size_t size = sizeof(saved);
+    nvs_handle_t handle;
+    if (nvs_open(CHECKPOINT_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+        return 0;
+    }
+    esp_err_t err = nvs_get_blob(handle, CHECKPOINT_KEY, &saved, &size);
+    nvs_close(handle);
+    if (err != ESP_OK || size != sizeof(saved)) {
+        return 0;
+    }
+    if (saved.partition_address != checkpoint->partition_address || saved.image_size != checkpoint->image_size ||
+            memcmp(saved.elf_sha256, checkpoint->elf_sha256, HASH_LEN) != 0 ||
+            saved.segment_size != checkpoint->segment_size || saved.offset > ota->image_size) {
+        ESP_LOGI(TAG, "Checkpoint of another download, starting from the beginning");
+        return 0;
+    }
+
+    uint8_t chain_hash[HASH_LEN] = { 0 };
+    for (uint32_t offset = 0; offset < saved.offset; offset += SEGMENT_SIZE) {
+        if (chain_segment(ota->partition, offset, chain_hash) != ESP_OK) {
+            return 0;
+        }
+    }
+    if (memcmp(chain_hash, saved.chain_hash, HASH_LEN) != 0) {
+        ESP_LOGW(TAG, "The flash does not match the checkpoint, starting from the beginning");
+        return 0;
+    }
+    *checkpoint = saved;
+    ESP_LOGI(TAG, "Resuming an interrupted download, %" PRIu32 " bytes already written", saved.offset);
+    return saved.offset;
+}
+
+/* Extends the hash chain over the segments that are now entirely written, and saves it. The prefix ends at the
+ * first range that is handed out but not written yet. Called with the lock held. */
+static void advance_checkpoint(parallel_ota_t *ota)
+{
+    uint32_t prefix = ota->next_offset;
+    for (int i = 0; i < CONFIG_EXAMPLE_PARALLEL_CONNECTIONS; i++) {
+        prefix = ota->in_flight[i] < prefix ? ota->in_flight[i] : prefix;
+    }
+    uint32_t offset = ota->checkpoint.offset;
+    while (prefix - ota->checkpoint.offset >= SEGMENT_SIZE) {
+        esp_err_t err = chain_segment(ota->partition, ota->checkpoint.offset, ota->checkpoint.chain_hash);
+        if (err != ESP_OK) {
+            // The chain no longer matches the prefix, the saved checkpoint stays the last good one
+            ESP_LOGE(TAG, "Failed to read back the written data: %s", esp_err_to_name(err));
+            ota->err = err;
+            return;
+        }
+        ota->checkpoint.offset += SEGMENT_SIZE;
+    }
+    if (ota->checkpoint.offset != offset) {
+        esp_err_t err = save_checkpoint(&ota->checkpoint);
+        if (err != ESP_OK) {
+            ESP_LOGW(TAG, "Failed to save the checkpoint: %s", esp_err_to_name(err));
+        }
+    }
+}
+
+/* Writes a range at its offset, erasing first the sectors it is the first range to reach. The ranges complete out of
+ * order, and an OTA handle either erases up front or only accepts sequential writes, so the partition is written
+ * directly: only the sectors the image covers are erased, each one when the first range over part of it is written,
+ * and the sectors of a resumed prefix are not erased again. Called with the lock held. */
+static esp_err_t write_range(parallel_ota_t *ota, uint32_t offset, const uint8_t *data, uint32_t length)
+{
+    for (uint32_t sector = offset / SPI_FLASH_SEC_SIZE; sector <= (offset + length - 1) / SPI_FLASH_SEC_SIZE; sector++) {
+        if (ota->erased[sector / 8] & (1 << (sector % 8))) {
+            continue;
+        }
+        esp_err_t err = esp_partition_erase_range(ota->partition, sector * SPI_FLASH_SEC_SIZE, SPI_FLASH_SEC_SIZE);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to erase sector %" PRIu32 " of partition %s: %s", sector, ota->partition->label,
+                     esp_err_to_name(err));
+            return err;
+        }
+        ota->erased[sector / 8] |= 1 << (sector % 8);
+    }
+    return esp_partition_write(ota->partition, offset, data, length);
+}
+
+static void log_connections(const parallel_ota_t *ota)
+{
+    if (ota->connections[0] > 0) {
+        ESP_LOGI(TAG, "%d connections set up with a full TLS handshake in %" PRId64 " ms on average",
+                 ota->connections[0], ota->connection_us[0] / ota->connections[0] / 1000);
+    }
+    if (ota->connections[1] > 0) {
+        int64_t resumed_us = ota->connection_us[1] / ota->connections[1];
+        ESP_LOGI(TAG, "%d connections set up with a saved TLS session in %" PRId64 " ms on average",
+                 ota->connections[1], resumed_us / 1000);
+        if (ota->connections[0] > 0) {
+            int64_t full_us = ota->connection_us[0] / ota->connections[0];
+            ESP_LOGI(TAG, "Handshake time saved by the TLS sessions: %" PRId64 " ms",
+                     (full_us - resumed_us) * ota->connections[1] / 1000);
+        }
+    }
+    if (ota->stalls > 0) {
+        ESP_LOGI(TAG, "%d stalled connections, recovered in %" PRId64 " ms on average", ota->stalls,
+                 ota->recovery_us / ota->stalls / 1000);
+    }
+}
+
+/* Each worker takes the next range not handed out yet, fetches it into its buffer and writes it at its offset. The
+ * ranges are written in the order they complete: a slow range holds back only its own worker, the others keep
+ * fetching the ranges after it. */
+static void worker_task(void *pvParameter)
+{
+    parallel_ota_worker_t *worker = pvParameter;
+    parallel_ota_t *ota = worker->ota;
+
+    while (1) {
+        xSemaphoreTake(ota->lock, portMAX_DELAY);
+        uint32_t offset = ota->next_offset;
+        uint32_t length = ota->image_size - offset < ota->range_size ? ota->image_size - offset : ota->range_size;
+        bool stop = ota->err != ESP_OK || length == 0;
+        if (!stop) {
+            ota->in_flight[worker->id] = offset;
+        }
+        ota->next_offset += length;
+        xSemaphoreGive(ota->lock);
+        if (stop) {
+            break;
+        }
+
+        esp_err_t err = fetch_range_with_retry(worker, offset, length);
+
+        xSemaphoreTake(ota->lock, portMAX_DELAY);
+        if (err == ESP_OK && ota->err == ESP_OK) {
+            err = write_range(ota, offset, worker->buffer, length);
+            if (err == ESP_OK) {
+                ota->in_flight[worker->id] = UINT32_MAX;
+                advance_checkpoint(ota);
+                ota->written += length;
+                ESP_LOGD(TAG, "Connection %d wrote range at 0x%" PRIx32 ", %" PRIu32 "/%" PRIu32 " bytes written",
+                         worker->id, offset, ota->written, ota->image_size);
+            }
+        }
+        if (err != ESP_OK && ota->err == ESP_OK) {
+            ESP_LOGE(TAG, "Connection %d failed on range at 0x%" PRIx32 ": %s", worker->id, offset,
+                     esp_err_to_name(err));
+            ota->err = err;
+        }
+        xSemaphoreGive(ota->lock);
+    }
+
+    xSemaphoreGive(ota->done);
+    vTaskDelete(NULL);
+}
+
+esp_err_t parallel_ota_download(const esp_http_client_config_t *http_config, parallel_ota_validate_cb_t validate_cb)
+{
+    parallel_ota_t ota = { .range_size = CONFIG_EXAMPLE_PARALLEL_RANGE_SIZE, .err = ESP_OK };
+    parallel_ota_worker_t *workers = s_workers;
+    esp_app_desc_t app_desc;
+    int started = 0;
+    esp_err_t err = ESP_OK;
+    int64_t start_time = esp_timer_get_time();
+
+    const esp_partition_t *partition = esp_ota_get_next_update_partition(NULL);
+    if (partition == NULL) {
+        ESP_LOGE(TAG, "No OTA partition to write the image to");
+        return ESP_ERR_NOT_FOUND;
+    }
+    ota.partition = partition;
+    ota.timeout_ms = http_config->timeout_ms;
+    for (int i = 0; i < CONFIG_EXAMPLE_PARALLEL_CONNECTIONS; i++) {
+        ota.in_flight[i] = UINT32_MAX;
+    }
+
+    ota.lock = xSemaphoreCreateMutex();
+    ota.done = xSemaphoreCreateCounting(CONFIG_EXAMPLE_PARALLEL_CONNECTIONS, 0);
+    if (ota.lock == NULL || ota.done == NULL) {
+        err = ESP_ERR_NO_MEM;
+        goto cleanup;
+    }
+    for (int i = 0; i < CONFIG_EXAMPLE_PARALLEL_CONNECTIONS; i++) {
+        workers[i].ota = &ota;
+        workers[i].id = i;
+        workers[i].stall_time = 0;
+        if (workers[i].client == NULL) {
+            workers[i].client = esp_http_client_init(http_config);
+        }
+        workers[i].buffer = malloc(RANGE_SIZE_MAX);
+        if (workers[i].client == NULL || workers[i].buffer == NULL) {
+            ESP_LOGE(TAG, "Failed to set up connection %d", i);
+            err = ESP_ERR_NO_MEM;
+            goto cleanup;
+        }
+    }
+
+    err = get_image_size(workers[0].client, &ota.image_size);
+    if (err != ESP_OK) {
+        goto cleanup;
+    }
+    if (ota.image_size > partition->size) {
+        ESP_LOGE(TAG, "Image of %" PRIu32 " bytes does not fit in partition %s (%" PRIu32 " bytes)",
+                 ota.image_size, partition->label, partition->size);
+        err = ESP_ERR_INVALID_SIZE;
+        goto cleanup;
+    }
+    uint32_t first_length = ota.image_size < ota.range_size ? ota.image_size : ota.range_size;
+    if (first_length < APP_DESC_OFFSET + sizeof(esp_app_desc_t)) {
+        ESP_LOGE(TAG, "Image of %" PRIu32 " bytes is too small", ota.image_size);
+        err = ESP_ERR_INVALID_SIZE;
+        goto cleanup;
+    }
+
+    // The first range is fetched alone, nothing is erased before its descriptor is accepted
+    err = fetch_range_with_retry(&workers[0], 0, first_length);
+    if (err == ESP_OK) {
+        err = check_image(workers[0].buffer, validate_cb, &app_desc);
+    }
+    if (err != ESP_OK) {
+        goto cleanup;
+    }
+
+    uint32_t start_offset = load_checkpoint(&ota, &app_desc);
+    if (start_offset == 0) {
+        clear_checkpoint();
+    }
+    // The prefix an interrupted download left is kept, its sectors, a whole number of them, are marked as erased
+    ota.erased = calloc((partition->size / SPI_FLASH_SEC_SIZE + 7) / 8, 1);
+    if (ota.erased == NULL) {
+        err = ESP_ERR_NO_MEM;
+        goto cleanup;
+    }
+    for (uint32_t sector = 0; sector < start_offset / SPI_FLASH_SEC_SIZE; sector++) {
+        ota.erased[sector / 8] |= 1 << (sector % 8);
+    }
+    if (first_length > start_offset) {
+        err = write_range(&ota, start_offset, workers[0].buffer + start_offset, first_length - start_offset);
+        if (err != ESP_OK) {
+            goto cleanup;
+        }
+        ota.written = first_length - start_offset;
+    }
+    ota.next_offset = first_length > start_offset ? first_length : start_offset;
+    advance_checkpoint(&ota);
+
+    ESP_LOGI(TAG, "Downloading %" PRIu32 " bytes over %d connections", ota.image_size - ota.next_offset,
+             CONFIG_EXAMPLE_PARALLEL_CONNECTIONS);
+    for (int i = 0; i < CONFIG_EXAMPLE_PARALLEL_CONNECTIONS; i++) {
+        if (xTaskCreate(&worker_task, "parallel_ota_worker", WORKER_STACK_SIZE, &workers[i], WORKER_PRIORITY,
+                        NULL) != pdPASS) {
+            ESP_LOGE(TAG, "Failed to start connection %d", i);
+            xSemaphoreTake(ota.lock, portMAX_DELAY);
+            ota.err = ESP_ERR_NO_MEM;
+            xSemaphoreGive(ota.lock);
+            break;
+        }
+        started++;
+    }
+    for (int i = 0; i < started; i++) {
+        xSemaphoreTake(ota.done, portMAX_DELAY);
+    }
+    err = ota.err;
+    if (err != ESP_OK) {
+        goto cleanup;
+    }
+
+    int64_t elapsed_ms = (esp_timer_get_time() - start_time) / 1000;
+    ESP_LOGI(TAG, "Image of %" PRIu32 " bytes written, %" PRIu32 " bytes downloaded in %" PRId64 " ms (%" PRId64
+             " KB/s)", ota.image_size, ota.written, elapsed_ms,
+             elapsed_ms > 0 ? (int64_t)ota.written * 1000 / 1024 / elapsed_ms : 0);
+    // Checks the segments, the hash and the signature of the image, as esp_ota_end() does
+    const esp_partition_pos_t part_pos = { .offset = partition->address, .size = partition->size };
+    esp_image_metadata_t metadata;
+    if (esp_image_verify(ESP_IMAGE_VERIFY, &part_pos, &metadata) != ESP_OK) {
+        ESP_LOGE(TAG, "Image validation failed, image is corrupted");
+        err = ESP_ERR_OTA_VALIDATE_FAILED;
+    } else {
+        err = esp_ota_set_boot_partition(partition);
+    }
+    // A corrupted image must not be resumed either
+    clear_checkpoint();
+
+cleanup:
+    log_connections(&ota);
+    free(ota.erased);
+    for (int i = 0; i < CONFIG_EXAMPLE_PARALLEL_CONNECTIONS; i++) {
+        // Closing the connection frees its TLS context, the client keeps the session for the next attempt
+        if (workers[i].client != NULL) {
+            esp_http_client_close(workers[i].client);
+        }
+        workers[i].connected = false;
+        free(workers[i].buffer);
+        workers[i].buffer = NULL;
+    }
+    if (ota.done != NULL) {
+        vSemaphoreDelete(ota.done);
+    }
+    if (ota.lock != NULL) {
+        vSemaphoreDelete(ota.lock);
+    }
+    return err;
+}
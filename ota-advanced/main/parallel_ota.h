@@ -0,0 +1,48 @@
+/* Parallel HTTPS OTA
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+#pragma once
+
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "esp_event.h"
+#include "esp_app_desc.h"
+#include "esp_http_client.h"
+
+ESP_EVENT_DECLARE_BASE(PARALLEL_OTA_EVENT);
+
+typedef enum {
+    PARALLEL_OTA_EVENT_RANGE_SIZE,      // The range size changed, data is a parallel_ota_range_size_t
+} parallel_ota_event_t;
+
+typedef enum {
+    PARALLEL_OTA_RANGE_GROW_RTT,        // The request round trip took too large a share of a range
+    PARALLEL_OTA_RANGE_SHRINK_SLOW,     // A range took longer than CONFIG_EXAMPLE_PARALLEL_RANGE_TIME_MS to transfer
+    PARALLEL_OTA_RANGE_SHRINK_FAILURE,  // A range failed
+} parallel_ota_range_reason_t;
+
+typedef struct {
+    uint32_t range_size;                // Size of the next ranges
+    uint32_t rtt_ms;                    // Smoothed time from a request to its response headers
+    uint32_t throughput;                // Smoothed transfer rate of one connection, in bytes/s
+    parallel_ota_range_reason_t reason;
+} parallel_ota_range_size_t;
+
+/* Called with the descriptor of the new image before anything is erased or written, the update is cancelled when
+ * it does not return ESP_OK */
+typedef esp_err_t (*parallel_ota_validate_cb_t)(esp_app_desc_t *new_app_info);
+
+/* Downloads the image at http_config->url over CONFIG_EXAMPLE_PARALLEL_CONNECTIONS connections, each one fetching
+ * the next range not handed out yet. The ranges start at CONFIG_EXAMPLE_PARALLEL_RANGE_SIZE bytes, and with
+ * CONFIG_EXAMPLE_PARALLEL_ADAPTIVE_RANGE_SIZE their size follows the measured round trip time, throughput and
+ * failures, each change being posted as a PARALLEL_OTA_EVENT_RANGE_SIZE event. The image is written to the next
+ * OTA partition, which is selected for the next boot when the whole image was written. The progress is checkpointed
+ * in NVS, and a call for the same image after a reset or a power loss continues from the last checkpoint. The HTTP
+ * clients are kept for the next call, which must pass the same http_config. */
+esp_err_t parallel_ota_download(const esp_http_client_config_t *http_config, parallel_ota_validate_cb_t validate_cb);
@@ -0,0 +1,137 @@
+/* Conditional update manifest check
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+#include <string.h>
+#include <strings.h>
+#include <inttypes.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "nvs.h"
+
+#include "update_manifest.h"
+
+#define MANIFEST_NAMESPACE "update_manifest"
+#define ETAG_KEY "etag"
+#define LAST_MODIFIED_KEY "last_modified"
+#define MAX_VALIDATOR_LEN 80
+
+typedef struct {
+    char etag[MAX_VALIDATOR_LEN];
+    char last_modified[MAX_VALIDATOR_LEN];
+} manifest_validators_t;
+
+static const char *TAG = "update_manifest";
+
+/* Validators of the last changed manifest, saved by update_manifest_commit() */
+static manifest_validators_t s_pending;
+static bool s_has_pending;
+
+static void load_validators(manifest_validators_t *validators)
+{
+    memset(validators, 0, sizeof(*validators));
+    nvs_handle_t handle;
+    if (nvs_open(MANIFEST_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+        return;
+    }
+    size_t len = sizeof(validators->etag);
+    if (nvs_get_str(handle, ETAG_KEY, validators->etag, &len) != ESP_OK) {
+        validators->etag[0] = '\0';
+    }
+    len = sizeof(validators->last_modified);
+    if (nvs_get_str(handle, LAST_MODIFIED_KEY, validators->last_modified, &len) != ESP_OK) {
+        validators->last_modified[0] = '\0';
+    }
+    nvs_close(handle);
+}
+
+// Collects the validators of the response, the values too long to be sent back are ignored
+static esp_err_t http_event_handler(esp_http_client_event_t *evt)
+{
+    manifest_validators_t *validators = evt->user_data;
+    if (evt->event_id != HTTP_EVENT_ON_HEADER || strlen(evt->header_value) >= MAX_VALIDATOR_LEN) {
+        return ESP_OK;
+    }
+    if (strcasecmp(evt->header_key, "ETag") == 0) {
+        strcpy(validators->etag, evt->header_value);
+    } else if (strcasecmp(evt->header_key, "Last-Modified") == 0) {
+        strcpy(validators->last_modified, evt->header_value);
+    }
+    return ESP_OK;
+}
+
+esp_err_t update_manifest_check(const esp_http_client_config_t *http_config, bool *changed)
+{
+    manifest_validators_t saved;
+    load_validators(&saved);
+
+    manifest_validators_t received = { 0 };
+    esp_http_client_config_t config = *http_config;
+    config.url = CONFIG_EXAMPLE_UPDATE_MANIFEST_URL;
+    config.event_handler = http_event_handler;
+    config.user_data = &received;
+    esp_http_client_handle_t client = esp_http_client_init(&config);
+    if (client == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    if (saved.etag[0] != '\0') {
+        esp_http_client_set_header(client, "If-None-Match", saved.etag);
+    }
+    if (saved.last_modified[0] != '\0') {
+        esp_http_client_set_header(client, "If-Modified-Since", saved.last_modified);
+    }
+
+    int64_t start_time = esp_timer_get_time();
+    esp_err_t err = esp_http_client_perform(client);
+    int status = esp_http_client_get_status_code(client);
+    esp_http_client_cleanup(client);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Manifest request failed: %s", esp_err_to_name(err));
+        return err;
+    }
+    ESP_LOGI(TAG, "Manifest status %d in %" PRId64 " ms", status, (esp_timer_get_time() - start_time) / 1000);
+
+    if (status == 304) {
+        *changed = false;
+        return ESP_OK;
+    }
+    if (status != 200) {
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+    *changed = true;
+    s_pending = received;
+    s_has_pending = received.etag[0] != '\0' || received.last_modified[0] != '\0';
+    if (!s_has_pending) {
+        ESP_LOGW(TAG, "The server sent no ETag or Last-Modified, every check downloads the manifest");
+    }
+    return ESP_OK;
+}
+
+esp_err_t update_manifest_commit(void)
+{
+    if (!s_has_pending) {
+        return ESP_OK;
+    }
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(MANIFEST_NAMESPACE, NVS_READWRITE, &handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = nvs_set_str(handle, ETAG_KEY, s_pending.etag);
+    if (err == ESP_OK) {
+        err = nvs_set_str(handle, LAST_MODIFIED_KEY, s_pending.last_modified);
+    }
+    if (err == ESP_OK) {
+        err = nvs_commit(handle);
+    }
+    nvs_close(handle);
+    if (err == ESP_OK) {
+        s_has_pending = false;
+    }
+    return err;
+}
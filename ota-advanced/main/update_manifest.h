@@ -0,0 +1,24 @@
+/* Conditional update manifest check
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+#pragma once
+
+#include <stdbool.h>
+
+#include "esp_err.h"
+#include "esp_http_client.h"
+
+/* Fetches CONFIG_EXAMPLE_UPDATE_MANIFEST_URL with the connection settings of http_config, sending the ETag and
+ * Last-Modified validators saved in NVS as If-None-Match and If-Modified-Since. *changed is false when the server
+ * answered 304 Not Modified, true otherwise. The validators of a changed manifest are only kept in RAM until
+ * update_manifest_commit() saves them. */
+esp_err_t update_manifest_check(const esp_http_client_config_t *http_config, bool *changed);
+
+/* Saves the validators of the last changed manifest, once the image it points to is installed or already running.
+ * Until then, each check reports the manifest as changed again, so that a failed update is retried. */
+esp_err_t update_manifest_commit(void);
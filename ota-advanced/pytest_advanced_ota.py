@@ -2,6 +2,7 @@
 # SPDX-License-Identifier: Unlicense OR CC0-1.0
 import http.server
 import multiprocessing
+import multiprocessing.synchronize
 import os
 import random
 import socket
@@ -55,6 +56,49 @@ def start_https_server(ota_image_dir: str, server_ip: str, server_port: int) ->
     httpd.serve_forever()
 
 
+def stalling_request_handler(stall_offset: int, stall_time: float,
+                             stalled: multiprocessing.synchronize.Event) -> Callable[...,http.server.BaseHTTPRequestHandler]:
+    """
+    Returns a request handler class that stops sending, once, for `stall_time` seconds after `stall_offset` bytes of a
+    response body, while keeping the connection open
+    """
+    RequestHandler = https_request_handler()
+
+    class StallingRequestHandler(RequestHandler):  # type: ignore
+        def copyfile(self, source, outputfile) -> None:  # type: ignore
+            class StallingWriter:
+                sent = 0
+
+                def write(self, data: bytes) -> None:
+                    if not stalled.is_set() and self.sent + len(data) > stall_offset:
+                        split = stall_offset - self.sent
+                        outputfile.write(data[:split])
+                        outputfile.flush()
+                        stalled.set()
+                        time.sleep(stall_time)
+                        self.sent += split
+                        data = data[split:]
+                    outputfile.write(data)
+                    self.sent += len(data)
+
+            RequestHandler.copyfile(self, source, StallingWriter())
+
+    return StallingRequestHandler
+
+
+def start_stalling_https_server(ota_image_dir: str, server_ip: str, server_port: int, stall_offset: int,
+                                stall_time: float, stalled: multiprocessing.synchronize.Event) -> None:
+    os.chdir(ota_image_dir)
+    requestHandler = stalling_request_handler(stall_offset, stall_time, stalled)
+    # The reconnection must be served while the stalled request still holds its connection
+    httpd = http.server.ThreadingHTTPServer((server_ip, server_port), requestHandler)
+
+    httpd.socket = ssl.wrap_socket(httpd.socket,
+                                   keyfile=key_file,
+                                   certfile=server_file, server_side=True)
+    httpd.serve_forever()
+
+
 def start_chunked_server(ota_image_dir: str, server_port: int) -> subprocess.Popen:
     os.chdir(ota_image_dir)
     chunked_server = subprocess.Popen(['openssl', 's_server', '-WWW', '-key', key_file, '-cert', server_file, '-port', str(server_port)])
@@ -148,6 +192,7 @@ def test_examples_protocol_advanced_https_ota_example_truncated_bin(dut: Dut) ->
       2. Generate truncated binary file
       3. Fetch OTA image over HTTPS
       4. Check working of code if bin is truncated
+      5. Check that the truncated image is rejected without waiting for the receive timeout
     """
     server_port = 8001
     # Original binary file generated after compilation
@@ -157,6 +202,7 @@ def test_examples_protocol_advanced_https_ota_example_truncated_bin(dut: Dut) ->
     # Size of truncated file to be grnerated. This value can range from 288 bytes (Image header size) to size of original binary file
     # truncated_bin_size is set to 64000 to reduce consumed by the test case
     truncated_bin_size = 64000
+    recv_timeout_ms = int(dut.app.sdkconfig.get('EXAMPLE_OTA_RECV_TIMEOUT'))
     binary_file = os.path.join(dut.app.binary_path, bin_name)
     with open(binary_file, 'rb+') as f:
         with open(os.path.join(dut.app.binary_path, truncated_bin_name), 'wb+') as fo:
@@ -178,8 +224,13 @@ def test_examples_protocol_advanced_https_ota_example_truncated_bin(dut: Dut) ->
         host_ip = get_host_ip4_by_dest_ip(ip_address)
 
         print('writing to device: {}'.format('https://' + host_ip + ':' + str(server_port) + '/' + truncated_bin_name))
+        start_time = time.time()
         dut.write('https://' + host_ip + ':' + str(server_port) + '/' + truncated_bin_name)
         dut.expect('Image validation failed, image is corrupted', timeout=30)
+        reject_ms = (time.time() - start_time) * 1000
+        print('Truncated image rejected in {:.0f} ms'.format(reject_ms))
+        # The server closes the connection at the end of the truncated image, nothing is left to time out
+        assert reject_ms < recv_timeout_ms
         try:
             os.remove(binary_file)
         except OSError:
@@ -188,6 +239,62 @@ def test_examples_protocol_advanced_https_ota_example_truncated_bin(dut: Dut) ->
         thread1.terminate()
 
 
+@pytest.mark.esp32
+@pytest.mark.esp32c3
+@pytest.mark.esp32s2
+@pytest.mark.esp32s3
+@pytest.mark.ethernet_ota
+@pytest.mark.parametrize('config', ['parallel_download',], indirect=True)
+def test_examples_protocol_advanced_https_ota_example_stalled_transfer(dut: Dut) -> None:
+    """
+    The server stops sending in the middle of a range without closing the connection. The stall must be detected
+    before the receive timeout, and the range continued over a new connection from the data already received.
+    steps: |
+      1. join AP/Ethernet
+      2. Fetch OTA image over HTTPS from a server that stalls once
+      3. Check the time taken to detect the stall and to recover from it
+      4. Reboot with the new OTA image
+    """
+    server_port = 8001
+    bin_name = 'advanced_https_ota.bin'
+    # The stall lasts much longer than the receive timeout, the download can only complete by recovering from it
+    stall_offset = 8192
+    stall_time = 30
+    recv_timeout_ms = int(dut.app.sdkconfig.get('EXAMPLE_OTA_RECV_TIMEOUT'))
+    stalled = multiprocessing.Event()
+    # Start server
+    thread1 = multiprocessing.Process(target=start_stalling_https_server,
+                                      args=(dut.app.binary_path, '0.0.0.0', server_port, stall_offset, stall_time, stalled))
+    thread1.daemon = True
+    thread1.start()
+    try:
+        # start test
+        dut.expect('Loaded app from partition at offset', timeout=30)
+        try:
+            ip_address = dut.expect(r'IPv4 address: (\d+\.\d+\.\d+\.\d+)[^\d]', timeout=30)[1].decode()
+            print('Connected to AP/Ethernet with IP: {}'.format(ip_address))
+        except pexpect.exceptions.TIMEOUT:
+            raise ValueError('ENV_TEST_FAILURE: Cannot connect to AP/Ethernet')
+        dut.expect('Starting Advanced OTA example', timeout=30)
+        host_ip = get_host_ip4_by_dest_ip(ip_address)
+
+        print('writing to device: {}'.format('https://' + host_ip + ':' + str(server_port) + '/' + bin_name))
+        dut.write('https://' + host_ip + ':' + str(server_port) + '/' + bin_name)
+        detect_ms = int(dut.expect(r'stalled, no data for (\d+) ms', timeout=60)[1].decode())
+        recovery_ms = int(dut.expect(r'recovered from the stall in (\d+) ms', timeout=30)[1].decode())
+        print('Stall detected after {} ms, recovered in {} ms'.format(detect_ms, recovery_ms))
+        assert stalled.is_set()
+        assert detect_ms < recv_timeout_ms
+        # The rest of the range is requested over a new connection right away, with no timeout to wait for
+        assert recovery_ms < recv_timeout_ms
+        dut.expect('upgrade successful. Rebooting ...', timeout=150)
+        # after reboot
+        dut.expect('Loaded app from partition at offset', timeout=30)
+        dut.expect('OTA example app_main start', timeout=20)
+    finally:
+        thread1.terminate()
+
+
 @pytest.mark.esp32
 @pytest.mark.esp32c3
 @pytest.mark.esp32s2
@@ -0,0 +1,70 @@
+#!/usr/bin/env python
+#
+# Compresses an app image for the compressed HTTPS OTA of the advanced example (CONFIG_EXAMPLE_COMPRESSED_IMAGE). The
+# image is written as a zlib or gzip stream with a 32 KB window, which the ROM tinfl decompressor of the device can
+# inflate. The stream is decompressed back in chunks of the size esp_https_ota passes to its decrypt callback, to
+# check it and to report the size saved against the decompression time on the host.
+#
+# SPDX-FileCopyrightText: 2023 Espressif Systems (Shanghai) CO LTD
+# SPDX-License-Identifier: Unlicense OR CC0-1.0
+
+import argparse
+import sys
+import time
+import zlib
+
+ESP_IMAGE_HEADER_MAGIC = 0xE9
+WINDOW_BITS = {'zlib': 15, 'gzip': 16 + 15} # 32 KB window, the dictionary size of tinfl
+DEFAULT_CHUNK_SIZE = 1024 # Default buffer size of esp_https_ota
+
+def compress(image: bytes, stream_format: str, level: int) -> bytes:
+    compressor = zlib.compressobj(level, zlib.DEFLATED, WINDOW_BITS[stream_format])
+    return compressor.compress(image) + compressor.flush()
+
+# Inflates the stream chunk by chunk, as the device does
+def decompress(stream: bytes, stream_format: str, chunk_size: int) -> bytes:
+    decompressor = zlib.decompressobj(WINDOW_BITS[stream_format])
+    output = bytearray()
+    for offset in range(0, len(stream), chunk_size):
+        output += decompressor.decompress(stream[offset:offset + chunk_size])
+    output += decompressor.flush()
+    if not decompressor.eof:
+        raise ValueError('truncated stream')
+    return bytes(output)
+
+def main() -> int:
+    parser = argparse.ArgumentParser(description='Compress an app image for the compressed HTTPS OTA')
+    parser.add_argument('image', help='app image, such as build/advanced_https_ota.bin')
+    parser.add_argument('-o', '--output', help='compressed image, <image>.zz or <image>.gz by default')
+    parser.add_argument('--format', choices=WINDOW_BITS.keys(), default='zlib', help='stream format')
+    parser.add_argument('--level', type=int, choices=range(1, 10), default=9, help='compression level')
+    parser.add_argument('--chunk_size', type=int, default=DEFAULT_CHUNK_SIZE,
+                        help='size of the chunks the stream is decompressed in')
+    args = parser.parse_args()
+
+    with open(args.image, 'rb') as f:
+        image = f.read()
+    if not image or image[0] != ESP_IMAGE_HEADER_MAGIC:
+        print(f'{args.image} is not an app image', file=sys.stderr)
+        return 1
+
+    start = time.perf_counter()
+    stream = compress(image, args.format, args.level)
+    compress_time = time.perf_counter() - start
+    start = time.perf_counter()
+    if decompress(stream, args.format, args.chunk_size) != image:
+        print('The compressed image does not decompress to the image', file=sys.stderr)
+        return 1
+    decompress_time = time.perf_counter() - start
+
+    output = args.output or args.image + ('.zz' if args.format == 'zlib' else '.gz')
+    with open(output, 'wb') as f:
+        f.write(stream)
+    print(f'{output}: {len(image)} -> {len(stream)} bytes ({len(stream) * 100 / len(image):.1f}%), '
+          f'{len(image) - len(stream)} bytes less to transfer')
+    print(f'Host compression {compress_time * 1000:.0f} ms, decompression in {args.chunk_size} byte chunks '
+          f'{decompress_time * 1000:.1f} ms')
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -7,12 +7,15 @@
    CONDITIONS OF ANY KIND, either express or implied.
 */
 
+#include <inttypes.h>
+
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 
 #include "esp_system.h"
 #include "esp_event.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "nvs_flash.h"
 
 #include "esp_http_client.h"
@@ -88,12 +91,19 @@ void simple_ota_example_task(void *pvParameter)
 };
 
     esp_https_ota_config_t ota_config = {
+#ifdef CONFIG_EXAMPLE_LAZY_FLASH_ERASE
+        // Each sector is erased by the first write to it, in between the writes of the download
+        .bulk_flash_erase = false,
+#else
         .bulk_flash_erase = true,
+#endif
         .http_config = &config,
     };
 
     ESP_LOGI(TAG, "Attempting to download firmware from %s", config.url);
+    int64_t start_time = esp_timer_get_time();
     esp_err_t ret = esp_https_ota(&ota_config);
+    ESP_LOGI(TAG, "OTA took %" PRId64 " ms", (esp_timer_get_time() - start_time) / 1000);
     if (ret == ESP_OK) {
         ESP_LOGI(TAG, "OTA succeeded, rebooting...");
         esp_restart();